@@ -0,0 +1,107 @@
+#include <asio/io_service.hpp>
+#include <asio/steady_timer.hpp>
+
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+
+#include <lwip/init.h>
+#include <lwip/netif.h>
+#include <lwip/timers.h>
+
+#include "macgyvernet.hpp"
+#include "backend.hpp"
+#include "metrics.hpp"
+
+DEFINE_string(backend, "auto", "Where lwIP's packets go: 'tun', 'script-tun' (openconnect --script-tun), 'loopback' (for benchmarks) or 'auto'");
+
+#ifdef MACGYVERNET_SERVER_PROFILE
+DEFINE_int32(lwip_memory_mb, 512, "Memory budget for lwIP's heap and pools in MiB");
+#endif
+
+void LwipTimer::schedule()
+{
+  u32_t sleep_ms = sys_timeouts_sleeptime();
+
+  if (sleep_ms == 0xFFFFFFFF) {
+    // No timeouts registered.
+    return;
+  }
+
+  auto new_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(sleep_ms);
+
+  // If the timer fires too early, it just reschedules itself. This
+  // way we don't need to cancel it for every packet.
+  if (armed and deadline <= new_deadline) {
+    return;
+  }
+
+  armed    = true;
+  deadline = new_deadline;
+
+  timer.expires_at(deadline);
+  timer.async_wait([this] (const asio::error_code &err) {
+      if (err == asio::error_code(asio::error::operation_aborted)) {
+        // We were rescheduled.
+        return;
+      } else if (err) {
+        LOG(ERROR) << "Timer error: " << err;
+        return;
+      }
+
+      armed = false;
+
+      sys_check_timeouts();
+      schedule();
+    });
+}
+
+void prepare_backend()
+{
+  // openconnect --script-tun sets VPNFD.
+  if (FLAGS_backend == "auto") {
+    FLAGS_backend = getenv("VPNFD") ? "script-tun" : "tun";
+  }
+
+  if (FLAGS_backend == "tun") {
+    open_tun_queues();
+  }
+}
+
+void initialize_backend(asio::io_service &io)
+{
+  static LwipTimer timer { io };
+
+#ifdef MACGYVERNET_SERVER_PROFILE
+  lwip_set_memory_budget(size_t(FLAGS_lwip_memory_mb) << 20);
+
+  register_gauge("macgyvernet_lwip_budget_used_bytes", "Bytes lwIP allocated from its memory budget.",
+                 [] { return lwip_memory_in_use(); });
+#endif
+
+  lwip_init();
+
+  LOG(INFO) << "lwIP initialized. Version: " << std::hex << LWIP_VERSION;
+
+  struct netif *netif = nullptr;
+
+  if (FLAGS_backend == "tun") {
+    netif = create_tun_backend(io, timer);
+  } else if (FLAGS_backend == "script-tun") {
+    netif = create_script_tun_backend(io, timer);
+  } else if (FLAGS_backend == "loopback") {
+    netif = create_loopback_backend(io, timer);
+  } else {
+    LOG(FATAL) << "Unknown backend '" << FLAGS_backend << "'.";
+  }
+
+  netif_set_default(netif);
+  netif_set_up(netif);
+  netif_set_link_up(netif);
+
+  timer.schedule();
+}
+
+// EOF
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <asio/io_service.hpp>
+#include <asio/steady_timer.hpp>
+
+#include <chrono>
+
+struct netif;
+
+/// Runs lwIP's timeouts from the io_service. There is one per
+/// process, because lwIP's timeouts are global.
+class LwipTimer {
+  asio::steady_timer timer;
+  bool armed = false;
+  std::chrono::steady_clock::time_point deadline;
+
+public:
+
+  LwipTimer(asio::io_service &io) : timer(io) {}
+
+  /// Make sure the timer fires when lwIP's next timeout is due. Call
+  /// this after lwIP had a chance to register new timeouts.
+  void schedule();
+};
+
+// A backend connects lwIP to the outside world. Each backend adds its
+// netif to lwIP, but leaves bringing it up to initialize_backend.
+
+/// With --shards, open one queue of the lwip0 TUN device per shard.
+/// Must be called before the shards are forked.
+void open_tun_queues();
+
+/// The lwip0 TUN device. Needs root or a prepared device (see
+/// tunsetup.sh).
+netif *create_tun_backend(asio::io_service &io, LwipTimer &timer);
+
+/// openconnect's --script-tun socket. Packets go straight between
+/// openconnect and lwIP without a kernel device. Addresses and MTU
+/// come from openconnect's environment.
+netif *create_script_tun_backend(asio::io_service &io, LwipTimer &timer);
+
+/// Loops packets back into lwIP itself. lwIP also plays the remote
+/// end and runs echo, discard and chargen services on its own
+/// address. For benchmarking without a network.
+netif *create_loopback_backend(asio::io_service &io, LwipTimer &timer);
+
+// EOF
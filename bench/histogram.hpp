@@ -0,0 +1,102 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+/// A latency histogram in the style of HdrHistogram. Buckets are
+/// linear within each power of two, so every recorded value keeps
+/// SUB_BUCKET_BITS significant bits (better than 1% precision) over
+/// the whole range of uint64_t. Recording is a few shifts and an
+/// increment. Histograms of different threads are merged at the end.
+class Histogram {
+
+  static const unsigned SUB_BUCKET_BITS = 7;
+  static const uint64_t SUB_BUCKETS     = 1 << SUB_BUCKET_BITS;
+  static const uint64_t HALF            = SUB_BUCKETS / 2;
+
+  std::vector<uint64_t> counts;
+  uint64_t total = 0;
+  uint64_t max   = 0;
+
+  static unsigned msb(uint64_t v) { return 63 - __builtin_clzll(v); }
+
+  static size_t index(uint64_t v)
+  {
+    if (v < SUB_BUCKETS) {
+      return v;
+    }
+
+    unsigned shift = msb(v) - SUB_BUCKET_BITS + 1;
+    return shift * HALF + (v >> shift);
+  }
+
+  /// The largest value that falls into the bucket.
+  static uint64_t highest_value(size_t idx)
+  {
+    if (idx < SUB_BUCKETS) {
+      return idx;
+    }
+
+    unsigned shift = (idx / HALF) - 1;
+    uint64_t sub   = idx - shift * HALF;
+    return ((sub + 1) << shift) - 1;
+  }
+
+public:
+
+  Histogram() : counts(index(UINT64_MAX) + 1) {}
+
+  void record(uint64_t v)
+  {
+    counts[index(v)]++;
+    total++;
+    max = std::max(max, v);
+  }
+
+  void merge(Histogram const &other)
+  {
+    for (size_t i = 0; i < counts.size(); i++) {
+      counts[i] += other.counts[i];
+    }
+
+    total += other.total;
+    max    = std::max(max, other.max);
+  }
+
+  uint64_t count() const { return total; }
+
+  /// The value below which fraction p of all values lie.
+  uint64_t percentile(double p) const
+  {
+    uint64_t rank = std::max<uint64_t>(1, p * total + 0.5);
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < counts.size(); i++) {
+      seen += counts[i];
+      if (seen >= rank) {
+        return std::min(highest_value(i), max);
+      }
+    }
+
+    return max;
+  }
+
+  /// Print a summary line. Values are divided by scale, e.g. to print
+  /// nanoseconds as microseconds.
+  void print(char const *name, char const *unit, double scale = 1) const
+  {
+    if (total == 0) {
+      printf("%-16s no samples\n", name);
+      return;
+    }
+
+    printf("%-16s p50 %9.1f  p90 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f %s (%llu samples)\n",
+           name,
+           percentile(0.5) / scale, percentile(0.9) / scale, percentile(0.99) / scale,
+           percentile(0.999) / scale, max / scale, unit, (unsigned long long)total);
+  }
+};
+
+// EOF
@@ -0,0 +1,246 @@
+#include <asio.hpp>
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+
+#include "histogram.hpp"
+
+// Benchmarks the whole path from a SOCKS client through lwIP. Run
+// macgyvernet with --backend=loopback and point this at it. The
+// remote ends are the loopback backend's echo, discard and chargen
+// services.
+
+DEFINE_string(proxy, "127.0.0.1", "Address of the SOCKS server");
+DEFINE_int32(proxy_port, 8080, "Port of the SOCKS server");
+DEFINE_string(target, "10.0.0.100", "Address of the echo, discard and chargen services behind the proxy");
+DEFINE_int32(seconds, 5, "Duration of each benchmark");
+DEFINE_int32(concurrency, 16, "Concurrent handshakes in the connection rate benchmark");
+DEFINE_int32(streams, 64, "Concurrent streams in the many-stream benchmarks");
+DEFINE_int32(request_bytes, 64, "Size of a request in the latency benchmark");
+
+using asio::ip::tcp;
+using clock_type = std::chrono::steady_clock;
+
+enum : uint16_t {
+  ECHO_PORT    = 7,
+  DISCARD_PORT = 9,
+  CHARGEN_PORT = 19,
+};
+
+static asio::io_service io;
+
+/// A connection through the SOCKS server.
+class Stream final : public std::enable_shared_from_this<Stream> {
+public:
+
+  using done_t = std::function<void (bool ok)>;
+
+  tcp::socket socket { io };
+  std::array<uint8_t, 64 << 10> buffer;
+
+  /// Connect to the SOCKS server and let it connect to port on the
+  /// target. Greeting and request are sent in one go.
+  void open(uint16_t port, done_t done)
+  {
+    auto self = shared_from_this();
+    tcp::endpoint proxy { asio::ip::address::from_string(FLAGS_proxy), uint16_t(FLAGS_proxy_port) };
+
+    socket.async_connect(proxy, [this, self, port, done] (const asio::error_code &error) {
+        if (error) {
+          done(false);
+          return;
+        }
+
+        socket.set_option(tcp::no_delay(true));
+
+        auto target = asio::ip::address_v4::from_string(FLAGS_target).to_bytes();
+        std::array<uint8_t, 13> request {{
+            // Version 5, one method: no authentication.
+            5, 1, 0,
+            // Version 5, CONNECT, reserved, IPv4 address and port.
+            5, 1, 0, 1, target[0], target[1], target[2], target[3],
+            uint8_t(port >> 8), uint8_t(port) }};
+
+        std::copy(request.begin(), request.end(), buffer.begin());
+
+        asio::async_write(socket, asio::buffer(buffer, request.size()),
+                          [this, self, done] (const asio::error_code &error, size_t) {
+                            if (error) {
+                              done(false);
+                              return;
+                            }
+
+                            // Method selection and a reply with an IPv4 address.
+                            asio::async_read(socket, asio::buffer(buffer, 2 + 10),
+                                             [this, self, done] (const asio::error_code &error, size_t) {
+                                               done(not error and buffer[1] == 0 and buffer[3] == 0);
+                                             });
+                          });
+      });
+  }
+};
+
+static bool before(clock_type::time_point deadline)
+{
+  return clock_type::now() < deadline;
+}
+
+static double seconds_since(clock_type::time_point start)
+{
+  return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+/// Run the io_service until the current benchmark is done.
+static void run()
+{
+  io.run();
+  io.reset();
+}
+
+static void connection_rate()
+{
+  auto start    = clock_type::now();
+  auto deadline = start + std::chrono::seconds(FLAGS_seconds);
+  uint64_t succeeded = 0;
+  uint64_t failed    = 0;
+
+  std::function<void ()> next = [&] {
+    if (not before(deadline)) {
+      return;
+    }
+
+    auto stream = std::make_shared<Stream>();
+    stream->open(DISCARD_PORT, [&, stream] (bool ok) {
+        (ok ? succeeded : failed)++;
+        stream->socket.close();
+        next();
+      });
+  };
+
+  for (int i = 0; i < FLAGS_concurrency; i++) {
+    next();
+  }
+
+  run();
+
+  printf("connections/s:          %10.1f (%llu failed)\n",
+         succeeded / seconds_since(start), (unsigned long long)failed);
+}
+
+/// Keep writing to or reading from the stream until the deadline.
+static void pump(std::shared_ptr<Stream> stream, bool upload, clock_type::time_point deadline,
+                 uint64_t &bytes)
+{
+  auto cb = [stream, upload, deadline, &bytes] (const asio::error_code &error, size_t len) {
+    bytes += len;
+
+    if (error or not before(deadline)) {
+      stream->socket.close();
+      return;
+    }
+
+    pump(stream, upload, deadline, bytes);
+  };
+
+  if (upload) {
+    stream->socket.async_write_some(asio::buffer(stream->buffer), cb);
+  } else {
+    stream->socket.async_read_some(asio::buffer(stream->buffer), cb);
+  }
+}
+
+static void throughput(char const *name, bool upload, int streams)
+{
+  auto start    = clock_type::now();
+  auto deadline = start + std::chrono::seconds(FLAGS_seconds);
+  uint64_t bytes  = 0;
+  unsigned failed = 0;
+
+  for (int i = 0; i < streams; i++) {
+    auto stream = std::make_shared<Stream>();
+    stream->open(upload ? DISCARD_PORT : CHARGEN_PORT, [&, stream] (bool ok) {
+        if (ok) {
+          pump(stream, upload, deadline, bytes);
+        } else {
+          failed++;
+        }
+      });
+  }
+
+  run();
+
+  printf("%-23s %10.1f MiB/s (%u of %d streams failed)\n", name,
+         bytes / seconds_since(start) / (1 << 20), failed, streams);
+}
+
+static void echo_once(std::shared_ptr<Stream> stream, clock_type::time_point deadline,
+                      Histogram &samples)
+{
+  if (not before(deadline)) {
+    stream->socket.close();
+    return;
+  }
+
+  auto sent = clock_type::now();
+  auto request = asio::buffer(stream->buffer, FLAGS_request_bytes);
+
+  asio::async_write(stream->socket, request,
+                    [stream, deadline, &samples, sent, request] (const asio::error_code &error, size_t) {
+                      if (error) {
+                        return;
+                      }
+
+                      asio::async_read(stream->socket, request,
+                                       [stream, deadline, &samples, sent] (const asio::error_code &error, size_t) {
+                                         if (error) {
+                                           return;
+                                         }
+
+                                         samples.record(seconds_since(sent) * 1e9);
+                                         echo_once(stream, deadline, samples);
+                                       });
+                    });
+}
+
+static void latency()
+{
+  auto deadline = clock_type::now() + std::chrono::seconds(FLAGS_seconds);
+  Histogram samples;
+
+  auto stream = std::make_shared<Stream>();
+  stream->open(ECHO_PORT, [&, stream] (bool ok) {
+      if (ok) {
+        echo_once(stream, deadline, samples);
+      }
+    });
+
+  run();
+
+  samples.print("request latency:", "us", 1e3);
+}
+
+int main(int argc, char **argv)
+{
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  CHECK_GT(FLAGS_request_bytes, 0);
+  CHECK_LE(FLAGS_request_bytes, 64 << 10);
+
+  connection_rate();
+  throughput("single-stream upload:",   true,  1);
+  throughput("single-stream download:", false, 1);
+  throughput("many-stream upload:",     true,  FLAGS_streams);
+  throughput("many-stream download:",   false, FLAGS_streams);
+  latency();
+
+  return 0;
+}
+
+// EOF
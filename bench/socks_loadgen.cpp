@@ -0,0 +1,375 @@
+#include <asio.hpp>
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "histogram.hpp"
+
+// Puts load on a SOCKS server with many concurrent connections from
+// several threads and measures each step of the SOCKS exchange. Like
+// socks-bench, this works best against macgyvernet --backend=loopback.
+//
+// Patterns:
+//   connect   Handshake, CONNECT, close. Repeat.
+//   rr        Request/response with the echo service on one connection.
+//   upload    Bulk transfer to the discard service.
+//   download  Bulk transfer from the chargen service.
+
+DEFINE_string(proxy, "127.0.0.1", "Address of the SOCKS server");
+DEFINE_int32(proxy_port, 8080, "Port of the SOCKS server");
+DEFINE_string(target, "10.0.0.100", "Address to CONNECT to through the proxy");
+DEFINE_int32(target_port, 0, "Port to CONNECT to. 0 picks the loopback service for the pattern.");
+DEFINE_string(pattern, "rr", "Traffic pattern: connect, rr, upload or download");
+DEFINE_int32(threads, 4, "Number of threads, each with its own io_service");
+DEFINE_int32(connections, 1000, "Concurrent connections over all threads");
+DEFINE_int32(seconds, 10, "Duration of the run");
+DEFINE_int32(request_bytes, 64, "Request size for the rr pattern");
+
+using asio::ip::tcp;
+using clock_type = std::chrono::steady_clock;
+
+enum class Pattern { CONNECT, RR, UPLOAD, DOWNLOAD };
+
+static Pattern pattern;
+static clock_type::time_point deadline;
+
+static uint64_t nanoseconds_since(clock_type::time_point start)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - start).count();
+}
+
+/// What one thread measured.
+struct Results {
+  // Connecting to the proxy until it selected an authentication method.
+  Histogram handshake;
+  // Sending CONNECT until the proxy's reply.
+  Histogram connect;
+  // The proxy's reply until the first byte of payload. Only for rr and
+  // download.
+  Histogram first_byte;
+  // Every request/response exchange of the rr pattern.
+  Histogram request;
+
+  uint64_t connections = 0;
+  uint64_t failures    = 0;
+  uint64_t bytes       = 0;
+
+  void merge(Results const &other)
+  {
+    handshake.merge(other.handshake);
+    connect.merge(other.connect);
+    first_byte.merge(other.first_byte);
+    request.merge(other.request);
+
+    connections += other.connections;
+    failures    += other.failures;
+    bytes       += other.bytes;
+  }
+};
+
+/// One connection slot. When a connection ends, the slot opens the
+/// next one until the deadline passes.
+class Client final : public std::enable_shared_from_this<Client> {
+  tcp::endpoint     proxy;
+  Results          &results;
+
+  tcp::socket socket;
+  std::array<uint8_t, 64 << 10> buffer;
+
+  clock_type::time_point step_start;
+  bool first_byte_pending = false;
+
+  void failed()
+  {
+    results.failures++;
+    restart();
+  }
+
+  void restart()
+  {
+    asio::error_code ignored;
+    socket.close(ignored);
+
+    if (clock_type::now() < deadline) {
+      start();
+    }
+  }
+
+  void proxy_connected_cb(const asio::error_code &error)
+  {
+    if (error) {
+      failed();
+      return;
+    }
+
+    socket.set_option(tcp::no_delay(true));
+
+    // Version 5, one method: no authentication.
+    static uint8_t const hello[] { 5, 1, 0 };
+
+    auto self = shared_from_this();
+    asio::async_write(socket, asio::buffer(hello), [this, self] (const asio::error_code &error, size_t) {
+        if (error) {
+          failed();
+          return;
+        }
+
+        asio::async_read(socket, asio::buffer(buffer, 2), [this, self] (const asio::error_code &error, size_t) {
+            method_selected_cb(error);
+          });
+      });
+  }
+
+  void method_selected_cb(const asio::error_code &error)
+  {
+    if (error or buffer[1] != 0) {
+      failed();
+      return;
+    }
+
+    results.handshake.record(nanoseconds_since(step_start));
+    step_start = clock_type::now();
+
+    uint16_t port   = FLAGS_target_port;
+    auto     target = asio::ip::address_v4::from_string(FLAGS_target).to_bytes();
+
+    std::array<uint8_t, 10> request {{
+        5, 1, 0, 1, target[0], target[1], target[2], target[3],
+        uint8_t(port >> 8), uint8_t(port) }};
+    std::copy(request.begin(), request.end(), buffer.begin());
+
+    auto self = shared_from_this();
+    asio::async_write(socket, asio::buffer(buffer, request.size()), [this, self] (const asio::error_code &error, size_t) {
+        if (error) {
+          failed();
+          return;
+        }
+
+        asio::async_read(socket, asio::buffer(buffer, 10), [this, self] (const asio::error_code &error, size_t) {
+            connect_replied_cb(error);
+          });
+      });
+  }
+
+  void connect_replied_cb(const asio::error_code &error)
+  {
+    if (error or buffer[1] != 0) {
+      failed();
+      return;
+    }
+
+    results.connect.record(nanoseconds_since(step_start));
+    results.connections++;
+
+    step_start         = clock_type::now();
+    first_byte_pending = true;
+
+    switch (pattern) {
+    case Pattern::CONNECT:  restart();      break;
+    case Pattern::RR:       send_request(); break;
+    case Pattern::UPLOAD:   upload();       break;
+    case Pattern::DOWNLOAD: download();     break;
+    }
+  }
+
+  void send_request()
+  {
+    if (clock_type::now() >= deadline) {
+      restart();
+      return;
+    }
+
+    auto request = asio::buffer(buffer, FLAGS_request_bytes);
+    auto sent    = clock_type::now();
+    auto self    = shared_from_this();
+
+    asio::async_write(socket, request, [this, self, sent] (const asio::error_code &error, size_t) {
+        if (error) {
+          failed();
+          return;
+        }
+
+        // Wait for the first byte of the response separately to measure
+        // time to first byte.
+        socket.async_read_some(asio::buffer(buffer, FLAGS_request_bytes),
+                               [this, self, sent] (const asio::error_code &error, size_t len) {
+                                 response_started_cb(error, len, sent);
+                               });
+      });
+  }
+
+  void response_started_cb(const asio::error_code &error, size_t len, clock_type::time_point sent)
+  {
+    if (error) {
+      failed();
+      return;
+    }
+
+    if (first_byte_pending) {
+      results.first_byte.record(nanoseconds_since(step_start));
+      first_byte_pending = false;
+    }
+
+    auto self = shared_from_this();
+    asio::async_read(socket, asio::buffer(buffer.data() + len, FLAGS_request_bytes - len),
+                     [this, self, len, sent] (const asio::error_code &error, size_t rest) {
+                       if (error) {
+                         failed();
+                         return;
+                       }
+
+                       results.request.record(nanoseconds_since(sent));
+                       results.bytes += len + rest;
+                       send_request();
+                     });
+  }
+
+  void upload()
+  {
+    auto self = shared_from_this();
+    socket.async_write_some(asio::buffer(buffer), [this, self] (const asio::error_code &error, size_t len) {
+        results.bytes += len;
+
+        if (error) {
+          failed();
+        } else if (clock_type::now() >= deadline) {
+          restart();
+        } else {
+          upload();
+        }
+      });
+  }
+
+  void download()
+  {
+    auto self = shared_from_this();
+    socket.async_read_some(asio::buffer(buffer), [this, self] (const asio::error_code &error, size_t len) {
+        results.bytes += len;
+
+        if (error) {
+          failed();
+          return;
+        }
+
+        if (first_byte_pending) {
+          results.first_byte.record(nanoseconds_since(step_start));
+          first_byte_pending = false;
+        }
+
+        if (clock_type::now() >= deadline) {
+          restart();
+        } else {
+          download();
+        }
+      });
+  }
+
+public:
+
+  Client(asio::io_service &io, tcp::endpoint const &proxy, Results &results)
+    : proxy(proxy), results(results), socket(io)
+  {}
+
+  void start()
+  {
+    step_start = clock_type::now();
+
+    auto self = shared_from_this();
+    socket.async_connect(proxy, [this, self] (const asio::error_code &error) {
+        proxy_connected_cb(error);
+      });
+  }
+};
+
+static void run_thread(unsigned connections, Results &results)
+{
+  asio::io_service io;
+  tcp::endpoint proxy { asio::ip::address::from_string(FLAGS_proxy), uint16_t(FLAGS_proxy_port) };
+
+  for (unsigned i = 0; i < connections; i++) {
+    std::make_shared<Client>(io, proxy, results)->start();
+  }
+
+  io.run();
+}
+
+static Pattern parse_pattern(std::string const &name)
+{
+  if (name == "connect")  return Pattern::CONNECT;
+  if (name == "rr")       return Pattern::RR;
+  if (name == "upload")   return Pattern::UPLOAD;
+  if (name == "download") return Pattern::DOWNLOAD;
+
+  LOG(FATAL) << "Unknown pattern '" << name << "'.";
+  return Pattern::CONNECT;
+}
+
+int main(int argc, char **argv)
+{
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  pattern = parse_pattern(FLAGS_pattern);
+
+  CHECK_GT(FLAGS_threads, 0);
+  CHECK_GT(FLAGS_request_bytes, 0);
+  CHECK_LE(FLAGS_request_bytes, 64 << 10);
+
+  if (FLAGS_target_port == 0) {
+    // The services of the loopback backend.
+    switch (pattern) {
+    case Pattern::CONNECT:
+    case Pattern::UPLOAD:   FLAGS_target_port = 9;  break;
+    case Pattern::RR:       FLAGS_target_port = 7;  break;
+    case Pattern::DOWNLOAD: FLAGS_target_port = 19; break;
+    }
+  }
+
+  // Histograms are large, so keep them off the stack.
+  std::vector<std::unique_ptr<Results>> per_thread;
+  std::vector<std::thread> threads;
+
+  auto start = clock_type::now();
+  deadline = start + std::chrono::seconds(FLAGS_seconds);
+
+  for (int i = 0; i < FLAGS_threads; i++) {
+    unsigned connections = FLAGS_connections / FLAGS_threads + (i < FLAGS_connections % FLAGS_threads);
+
+    per_thread.emplace_back(new Results);
+    threads.emplace_back(run_thread, connections, std::ref(*per_thread.back()));
+  }
+
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+
+  Results total;
+  for (auto const &r : per_thread) {
+    total.merge(*r);
+  }
+
+  printf("%llu connections (%.1f/s), %llu failures, %.1f MiB/s\n",
+         (unsigned long long)total.connections, total.connections / seconds,
+         (unsigned long long)total.failures, total.bytes / seconds / (1 << 20));
+
+  total.handshake.print("handshake:", "us", 1e3);
+  total.connect.print("connect:", "us", 1e3);
+  total.first_byte.print("first byte:", "us", 1e3);
+
+  if (pattern == Pattern::RR) {
+    total.request.print("request:", "us", 1e3);
+  }
+
+  return 0;
+}
+
+// EOF
@@ -0,0 +1,51 @@
+#include <new>
+
+#include "buffer_pool.hpp"
+#include "metrics.hpp"
+
+BufferPool::~BufferPool()
+{
+  while (free_list) {
+    Buffer *b = free_list;
+    free_list = b->next_free;
+    ::operator delete(b);
+  }
+}
+
+BufferPool::Ref BufferPool::get()
+{
+  Buffer *b = free_list;
+
+  if (b) {
+    free_list = b->next_free;
+    free_count--;
+  } else {
+    b = static_cast<Buffer *>(::operator new(sizeof(Buffer) + buffer_size));
+    b->pool = this;
+    allocated++;
+  }
+
+  b->refs      = 1;
+  b->next_free = nullptr;
+
+  metrics().buffers_taken++;
+
+  return Ref { b };
+}
+
+void BufferPool::put(Buffer *b)
+{
+  metrics().buffers_returned++;
+
+  if (free_count >= max_cached) {
+    allocated--;
+    ::operator delete(b);
+    return;
+  }
+
+  b->next_free = free_list;
+  free_list    = b;
+  free_count++;
+}
+
+// EOF
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/// A pool of fixed-size, reference counted buffers. A buffer goes
+/// back to the pool, when its last reference is dropped. This is not
+/// thread-safe.
+class BufferPool {
+
+  struct Buffer {
+    BufferPool *pool;
+    unsigned    refs;
+    Buffer     *next_free;
+
+    uint8_t *data() { return reinterpret_cast<uint8_t *>(this + 1); }
+  };
+
+  size_t const buffer_size;
+  size_t const max_cached;
+
+  Buffer *free_list = nullptr;
+  size_t  free_count = 0;
+  size_t  allocated  = 0;
+
+  void put(Buffer *buf);
+
+public:
+
+  /// A counted reference to a buffer.
+  class Ref {
+    friend class BufferPool;
+
+    Buffer *buf = nullptr;
+
+    explicit Ref(Buffer *b) : buf(b) { }
+
+  public:
+    Ref() = default;
+
+    Ref(Ref const &o) : buf(o.buf) { if (buf) buf->refs++; }
+    Ref(Ref &&o) : buf(o.buf) { o.buf = nullptr; }
+
+    Ref &operator=(Ref o)
+    {
+      Buffer *t = buf;
+      buf = o.buf;
+      o.buf = t;
+      return *this;
+    }
+
+    ~Ref() { reset(); }
+
+    void reset()
+    {
+      if (buf and --buf->refs == 0) {
+        buf->pool->put(buf);
+      }
+      buf = nullptr;
+    }
+
+    explicit operator bool() const { return buf != nullptr; }
+    bool operator==(Ref const &o) const { return buf == o.buf; }
+
+    /// True, if noone else references this buffer.
+    bool unique() const { return buf and buf->refs == 1; }
+
+    uint8_t *data() const { return buf->data(); }
+    size_t   size() const { return buf->pool->buffer_size; }
+  };
+
+  /// Create a pool that hands out buffers of buffer_size bytes and
+  /// keeps at most max_cached unused buffers around.
+  BufferPool(size_t buffer_size, size_t max_cached)
+    : buffer_size(buffer_size), max_cached(max_cached)
+  { }
+
+  BufferPool(BufferPool const &) = delete;
+  BufferPool &operator=(BufferPool const &) = delete;
+
+  ~BufferPool();
+
+  Ref get();
+
+  /// Number of buffers currently handed out.
+  size_t in_use() const { return allocated - free_count; }
+
+  /// Number of buffers allocated from the heap in total.
+  size_t total() const { return allocated; }
+};
+
+// EOF
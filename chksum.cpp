@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include <arch/cc.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define MACGYVERNET_X86 1
+#endif
+
+// The Internet checksum (RFC 1071) is the one's complement sum of
+// 16-bit words. The sum doesn't depend on byte order and words of any
+// width can be added up as long as the result is folded to 16 bits in
+// the end. All versions below add native words and return the same
+// as lwip_standard_chksum: the sum in network byte order, not yet
+// complemented.
+//
+// The SIMD versions zero-extend 16-bit words into 32-bit lanes. A lane
+// gets two words per iteration, so after this many iterations we move
+// the lanes into the 64-bit sum before they can overflow.
+static size_t const MAX_SIMD_ITERATIONS = 1 << 15;
+
+static u16_t fold(uint64_t sum)
+{
+  while (sum >> 16) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  }
+
+  return sum;
+}
+
+static uint64_t sum_scalar(uint8_t const *p, size_t len, uint64_t sum)
+{
+  for (; len >= 4; p += 4, len -= 4) {
+    uint32_t w;
+    memcpy(&w, p, sizeof(w));
+    sum += w;
+  }
+
+  if (len >= 2) {
+    uint16_t w;
+    memcpy(&w, p, sizeof(w));
+    sum += w;
+    p += 2; len -= 2;
+  }
+
+  if (len) {
+    // A trailing byte is the first byte of a word padded with zero.
+    uint16_t w = 0;
+    memcpy(&w, p, 1);
+    sum += w;
+  }
+
+  return sum;
+}
+
+static uint64_t copy_sum_scalar(uint8_t *dst, uint8_t const *src, size_t len, uint64_t sum)
+{
+  for (; len >= 4; dst += 4, src += 4, len -= 4) {
+    uint32_t w;
+    memcpy(&w, src, sizeof(w));
+    memcpy(dst, &w, sizeof(w));
+    sum += w;
+  }
+
+  memcpy(dst, src, len);
+  return sum_scalar(dst, len, sum);
+}
+
+#ifdef MACGYVERNET_X86
+
+__attribute__((target("sse2")))
+static uint64_t lanes_sse2(__m128i acc)
+{
+  alignas(16) uint32_t l[4];
+  _mm_store_si128(reinterpret_cast<__m128i *>(l), acc);
+
+  return uint64_t(l[0]) + l[1] + l[2] + l[3];
+}
+
+__attribute__((target("sse2")))
+static uint64_t sum_sse2(uint8_t const *p, size_t len, uint64_t sum)
+{
+  __m128i const zero = _mm_setzero_si128();
+
+  while (len >= 16) {
+    size_t  n   = std::min(len / 16, MAX_SIMD_ITERATIONS);
+    __m128i acc = zero;
+
+    for (size_t i = 0; i < n; i++, p += 16) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(p));
+      acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+      acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+    }
+
+    len -= n * 16;
+    sum += lanes_sse2(acc);
+  }
+
+  return sum_scalar(p, len, sum);
+}
+
+__attribute__((target("sse2")))
+static uint64_t copy_sum_sse2(uint8_t *dst, uint8_t const *src, size_t len, uint64_t sum)
+{
+  __m128i const zero = _mm_setzero_si128();
+
+  while (len >= 16) {
+    size_t  n   = std::min(len / 16, MAX_SIMD_ITERATIONS);
+    __m128i acc = zero;
+
+    for (size_t i = 0; i < n; i++, src += 16, dst += 16) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), v);
+      acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+      acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+    }
+
+    len -= n * 16;
+    sum += lanes_sse2(acc);
+  }
+
+  return copy_sum_scalar(dst, src, len, sum);
+}
+
+__attribute__((target("avx2")))
+static uint64_t lanes_avx2(__m256i acc)
+{
+  __m128i half = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+
+  alignas(16) uint32_t l[4];
+  _mm_store_si128(reinterpret_cast<__m128i *>(l), half);
+
+  return uint64_t(l[0]) + l[1] + l[2] + l[3];
+}
+
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(uint8_t const *p, size_t len, uint64_t sum)
+{
+  __m256i const zero = _mm256_setzero_si256();
+
+  while (len >= 32) {
+    // Half the iterations, because lanes_avx2 adds two lanes before
+    // widening.
+    size_t  n   = std::min(len / 32, MAX_SIMD_ITERATIONS / 2);
+    __m256i acc = zero;
+
+    for (size_t i = 0; i < n; i++, p += 32) {
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(p));
+      acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+      acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+    }
+
+    len -= n * 32;
+    sum += lanes_avx2(acc);
+  }
+
+  return sum_sse2(p, len, sum);
+}
+
+__attribute__((target("avx2")))
+static uint64_t copy_sum_avx2(uint8_t *dst, uint8_t const *src, size_t len, uint64_t sum)
+{
+  __m256i const zero = _mm256_setzero_si256();
+
+  while (len >= 32) {
+    size_t  n   = std::min(len / 32, MAX_SIMD_ITERATIONS / 2);
+    __m256i acc = zero;
+
+    for (size_t i = 0; i < n; i++, src += 32, dst += 32) {
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(src));
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), v);
+      acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+      acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+    }
+
+    len -= n * 32;
+    sum += lanes_avx2(acc);
+  }
+
+  return copy_sum_sse2(dst, src, len, sum);
+}
+
+#endif
+
+struct ChksumImplementation {
+  uint64_t (*sum)(uint8_t const *p, size_t len, uint64_t sum);
+  uint64_t (*copy_sum)(uint8_t *dst, uint8_t const *src, size_t len, uint64_t sum);
+};
+
+static ChksumImplementation select_implementation()
+{
+#ifdef MACGYVERNET_X86
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    return { sum_avx2, copy_sum_avx2 };
+  }
+
+  if (__builtin_cpu_supports("sse2")) {
+    return { sum_sse2, copy_sum_sse2 };
+  }
+#endif
+
+  return { sum_scalar, copy_sum_scalar };
+}
+
+// lwIP only computes checksums once main() runs, so this is set up by
+// then.
+static ChksumImplementation const implementation = select_implementation();
+
+u16_t macgyvernet_chksum(const void *dataptr, int len)
+{
+  return fold(implementation.sum(static_cast<uint8_t const *>(dataptr), len, 0));
+}
+
+u16_t macgyvernet_chksum_copy(void *dst, const void *src, u16_t len)
+{
+  return fold(implementation.copy_sum(static_cast<uint8_t *>(dst),
+                                      static_cast<uint8_t const *>(src), len, 0));
+}
+
+// EOF
@@ -24,14 +24,20 @@ typedef uintptr_t mem_ptr_t;
 # endif
 #endif
 
-#define LWIP_CHKSUM_ALGORITHM 1
-
 #ifdef __cplusplus
 # define EXTERN_C extern "C"
 #else
 # define EXTERN_C
 #endif
 
+/* Checksum routines from chksum.cpp. They pick an SSE2 or AVX2
+   version at runtime. */
+#define LWIP_CHKSUM      macgyvernet_chksum
+#define LWIP_CHKSUM_COPY macgyvernet_chksum_copy
+
+EXTERN_C u16_t macgyvernet_chksum(const void *dataptr, int len);
+EXTERN_C u16_t macgyvernet_chksum_copy(void *dst, const void *src, u16_t len);
+
 EXTERN_C void lwip_platform_diag(const char *m, ...);
 EXTERN_C void lwip_platform_assert(const char *file, int line, const char *msg);
 
@@ -0,0 +1,46 @@
+#include <asio/io_service.hpp>
+
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "io_threads.hpp"
+
+DEFINE_int32(io_threads, 0, "Threads for SOCKS client socket I/O. 0 does all I/O on the lwIP thread.");
+
+static std::vector<asio::io_service *> client_io_services;
+static size_t next_client_io = 0;
+
+void start_io_threads(asio::io_service &lwip_io)
+{
+  CHECK_GE(FLAGS_io_threads, 0);
+
+  if (FLAGS_io_threads == 0) {
+    client_io_services.push_back(&lwip_io);
+    return;
+  }
+
+  for (int i = 0; i < FLAGS_io_threads; i++) {
+    // These live as long as the process.
+    auto *io = new asio::io_service;
+    new asio::io_service::work(*io);
+
+    client_io_services.push_back(io);
+
+    std::thread([io] { io->run(); }).detach();
+  }
+
+  LOG(INFO) << "Started " << FLAGS_io_threads << " I/O threads.";
+}
+
+asio::io_service &next_client_io_service()
+{
+  asio::io_service &io = *client_io_services[next_client_io];
+  next_client_io = (next_client_io + 1) % client_io_services.size();
+
+  return io;
+}
+
+// EOF
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <asio/io_service.hpp>
+
+// With --io_threads > 0, SOCKS client sockets are spread over that
+// many threads, each running its own io_service. lwIP stays on the
+// thread that calls start_io_threads(). See SocksClient for how the
+// two sides talk to each other.
+
+/// Start the I/O threads. lwip_io is used for client sockets, if
+/// there are none.
+void start_io_threads(asio::io_service &lwip_io);
+
+/// The io_service for the next client socket. Round robin.
+asio::io_service &next_client_io_service();
+
+// EOF
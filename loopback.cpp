@@ -0,0 +1,253 @@
+#include <asio/io_service.hpp>
+
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+#include <array>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include <lwip/netif.h>
+#include <lwip/ip.h>
+#include <lwip/pbuf.h>
+#include <lwip/tcp.h>
+
+#include "macgyvernet.hpp"
+#include "backend.hpp"
+#include "metrics.hpp"
+
+DECLARE_int32(mtu);
+
+// lwIP has global state, so we can't run a second stack as the remote
+// end. Instead, the loopback interface feeds lwIP's packets back into
+// lwIP itself and lwIP also plays the remote end by running a few
+// classic test services on the interface address. A SOCKS connection
+// to 10.0.0.100 thus goes through lwIP's TCP twice: once for our end
+// and once for the service's end.
+
+class LoopbackInterface : public netif {
+
+  asio::io_service &io_service;
+  LwipTimer        &timer;
+
+  // Packets lwIP sent, but did not receive yet. Delivering them later
+  // instead of from packet_output avoids reentering lwIP.
+  std::vector<pbuf *> pending;
+  std::vector<pbuf *> delivering;
+  bool delivery_posted = false;
+
+  void deliver()
+  {
+    delivery_posted = false;
+    std::swap(pending, delivering);
+
+    for (pbuf *p : delivering) {
+      if (input(p, this) != ERR_OK) {
+        pbuf_free(p);
+      }
+    }
+    delivering.clear();
+
+    timer.schedule();
+  }
+
+  err_t packet_output(pbuf *p)
+  {
+    // lwIP keeps TCP segments for retransmission, so we need a copy.
+    pbuf *q = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_POOL);
+    if (not q) {
+      metrics().pbuf_alloc_failures++;
+      return ERR_MEM;
+    }
+
+    pbuf_copy(q, p);
+    pending.push_back(q);
+
+    if (not delivery_posted) {
+      delivery_posted = true;
+      io_service.post([this] { deliver(); });
+    }
+
+    timer.schedule();
+    return ERR_OK;
+  }
+
+  err_t netif_init()
+  {
+    CHECK_EQ(state, this);
+
+    name[0] = 'l';
+    name[1] = 'o';
+    mtu     = FLAGS_mtu;
+    output  = &LoopbackInterface::static_packet_output;
+
+    return ERR_OK;
+  }
+
+public:
+
+  LoopbackInterface(asio::io_service &io, LwipTimer &timer)
+    : io_service(io), timer(timer)
+  {
+    memset(static_cast<netif *>(this), 0, sizeof(netif));
+  }
+
+  static err_t static_netif_init(netif *netif)
+  {
+    return static_cast<LoopbackInterface *>(netif)->netif_init();
+  }
+
+  static err_t static_packet_output(netif *netif, pbuf *p, ip_addr_t const *)
+  {
+    return static_cast<LoopbackInterface *>(netif)->packet_output(p);
+  }
+};
+
+// The services. They keep no state besides the PCB. The listening
+// PCB's argument, which accepted PCBs inherit, is the port.
+
+enum : uint16_t {
+  ECHO_PORT    = 7,
+  DISCARD_PORT = 9,
+  CHARGEN_PORT = 19,
+};
+
+static uint16_t service_port(void *arg)
+{
+  return uint16_t(reinterpret_cast<uintptr_t>(arg));
+}
+
+/// Data chargen sends. lwIP references it without copying.
+static std::array<uint8_t, 64 << 10> chargen_data;
+
+static void chargen_fill(struct tcp_pcb *pcb)
+{
+  while (tcp_sndbuf(pcb)) {
+    uint16_t len = std::min<size_t>({ tcp_sndbuf(pcb), chargen_data.size(), 0xFFFF });
+
+    if (tcp_write(pcb, chargen_data.data(), len, 0) != ERR_OK) {
+      break;
+    }
+  }
+
+  tcp_output(pcb);
+}
+
+static err_t service_close(struct tcp_pcb *pcb)
+{
+  tcp_arg(pcb, nullptr);
+  tcp_recv(pcb, nullptr);
+  tcp_sent(pcb, nullptr);
+
+  if (tcp_close(pcb) != ERR_OK) {
+    tcp_abort(pcb);
+    return ERR_ABRT;
+  }
+
+  return ERR_OK;
+}
+
+static err_t service_recv_cb(void *arg, struct tcp_pcb *pcb, pbuf *p, err_t err)
+{
+  if (not p) {
+    return service_close(pcb);
+  }
+
+  if (service_port(arg) == ECHO_PORT) {
+    // Each write may extend the last segment and add new ones. All
+    // writes have to succeed, because lwIP offers p again as a whole.
+    size_t segments = 0;
+    for (pbuf *c = p; c; c = c->next) {
+      segments += c->len / pcb->mss + 2;
+    }
+
+    if (tcp_sndbuf(pcb) < p->tot_len or tcp_sndqueuelen(pcb) + segments > TCP_SND_QUEUELEN) {
+      // lwIP offers the data again later.
+      return ERR_MEM;
+    }
+
+    for (pbuf *c = p; c; c = c->next) {
+      if (tcp_write(pcb, c->payload, c->len, TCP_WRITE_FLAG_COPY) != ERR_OK) {
+        // Part of p is queued already, so we can't take it back.
+        LOG(ERROR) << "Echo service out of memory. Resetting connection.";
+        tcp_abort(pcb);
+        pbuf_free(p);
+        return ERR_ABRT;
+      }
+    }
+    tcp_output(pcb);
+  }
+
+  tcp_recved(pcb, p->tot_len);
+  pbuf_free(p);
+
+  return ERR_OK;
+}
+
+static err_t service_sent_cb(void *arg, struct tcp_pcb *pcb, uint16_t)
+{
+  if (service_port(arg) == CHARGEN_PORT) {
+    chargen_fill(pcb);
+  }
+
+  return ERR_OK;
+}
+
+static err_t service_accept_cb(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+  if (err != ERR_OK) {
+    return err;
+  }
+
+  tcp_recv(pcb, service_recv_cb);
+  tcp_sent(pcb, service_sent_cb);
+
+  if (service_port(arg) == CHARGEN_PORT) {
+    chargen_fill(pcb);
+  }
+
+  return ERR_OK;
+}
+
+static void start_service(uint16_t port)
+{
+  struct tcp_pcb *pcb = tcp_new();
+  CHECK(pcb);
+
+  CHECK_EQ(tcp_bind(pcb, IP_ADDR_ANY, port), ERR_OK);
+
+  pcb = tcp_listen(pcb);
+  CHECK(pcb);
+
+  tcp_arg(pcb, reinterpret_cast<void *>(uintptr_t(port)));
+  tcp_accept(pcb, service_accept_cb);
+}
+
+netif *create_loopback_backend(asio::io_service &io, LwipTimer &timer)
+{
+  static LoopbackInterface loif { io, timer };
+
+  ip_addr_t ipaddr, netmask, gw;
+
+  IP4_ADDR(&gw, 10,0,0,1);
+  IP4_ADDR(&ipaddr, 10,0,0,100);
+  IP4_ADDR(&netmask, 255,0,0,0);
+
+  netif_add(&loif, &ipaddr, &netmask, &gw, &loif,
+            &LoopbackInterface::static_netif_init, ip4_input);
+
+  for (size_t i = 0; i < chargen_data.size(); i++) {
+    chargen_data[i] = ' ' + i % 95;
+  }
+
+  start_service(ECHO_PORT);
+  start_service(DISCARD_PORT);
+  start_service(CHARGEN_PORT);
+
+  LOG(INFO) << "Loopback backend: echo, discard and chargen are on 10.0.0.100 ports "
+            << ECHO_PORT << ", " << DISCARD_PORT << " and " << CHARGEN_PORT << ".";
+
+  return &loif;
+}
+
+// EOF
@@ -1,4 +1,7 @@
 #include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
 #include <arch/cc.h>
 #include <lwip/sys.h>
 #include <glog/logging.h>
@@ -30,7 +33,58 @@ u32_t sys_now()
   static auto boot_time = std::chrono::steady_clock::now();
 
   auto now = std::chrono::steady_clock::now();
-  return std::chrono::duration_cast<std::chrono::microseconds>(now - boot_time).count();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(now - boot_time).count();
 }
 
+#ifdef MACGYVERNET_SERVER_PROFILE
+
+// lwIP's heap and pools are allocated with malloc(), but only up to
+// this many bytes.
+static size_t lwip_memory_budget = 0;
+static size_t lwip_memory_used   = 0;
+
+void lwip_set_memory_budget(size_t bytes)
+{
+  lwip_memory_budget = bytes;
+}
+
+size_t lwip_memory_in_use()
+{
+  return lwip_memory_used;
+}
+
+void *lwip_budget_malloc(size_t size)
+{
+  if (lwip_memory_used + size > lwip_memory_budget) {
+    return nullptr;
+  }
+
+  void *ptr = malloc(size);
+  if (ptr) {
+    lwip_memory_used += malloc_usable_size(ptr);
+  }
+
+  return ptr;
+}
+
+void *lwip_budget_calloc(size_t count, size_t size)
+{
+  void *ptr = lwip_budget_malloc(count * size);
+  if (ptr) {
+    memset(ptr, 0, count * size);
+  }
+
+  return ptr;
+}
+
+void lwip_budget_free(void *ptr)
+{
+  if (ptr) {
+    lwip_memory_used -= malloc_usable_size(ptr);
+    free(ptr);
+  }
+}
+
+#endif
+
 /* EOF */
@@ -57,6 +57,70 @@
  */
 #define NO_SYS                          1
 
+/*
+   ------------------------------------
+   ---------- Server profile ----------
+   ------------------------------------
+*/
+/**
+ * MACGYVERNET_SERVER_PROFILE: Defined when building with
+ * `scons profile=server`. Sizes lwIP for thousands of connections
+ * and multi-megabyte windows instead of a handful of small ones.
+ *
+ * All pools and the heap are allocated with malloc(), but the total
+ * is capped by a memory budget that is set at startup with
+ * --lwip_memory_mb (see lwip_set_memory_budget).
+ */
+#ifdef MACGYVERNET_SERVER_PROFILE
+
+#ifndef __ASSEMBLER__
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+void *lwip_budget_malloc(size_t size);
+void *lwip_budget_calloc(size_t count, size_t size);
+void  lwip_budget_free(void *ptr);
+
+/* Limit the memory lwIP may allocate. */
+void  lwip_set_memory_budget(size_t bytes);
+
+/* Bytes lwIP currently has allocated from its budget. */
+size_t lwip_memory_in_use(void);
+#ifdef __cplusplus
+}
+#endif
+#endif
+
+#define MEM_LIBC_MALLOC                 1
+#define MEMP_MEM_MALLOC                 1
+#define mem_malloc                      lwip_budget_malloc
+#define mem_calloc                      lwip_budget_calloc
+#define mem_free                        lwip_budget_free
+
+/* With MEMP_MEM_MALLOC these are only upper bounds lwIP checks its
+   configuration against. The budget is the real limit. */
+#define MEM_SIZE                        (64 * 1024 * 1024)
+#define MEMP_NUM_PBUF                   65535
+#define MEMP_NUM_UDP_PCB                1024
+#define MEMP_NUM_TCP_PCB                16384
+#define MEMP_NUM_TCP_SEG                65535
+#define PBUF_POOL_SIZE                  65535
+
+#define TCP_MSS                         1460
+
+/* Window scaling allows receive windows above 64 KiB. 0xFFFF << 7
+   covers the 4 MiB window. */
+#define LWIP_WND_SCALE                  1
+#define TCP_RCV_SCALE                   7
+#define TCP_WND                         (4 * 1024 * 1024)
+
+#define TCP_SND_BUF                     (4 * 1024 * 1024)
+#define TCP_SND_QUEUELEN                ((4 * (TCP_SND_BUF) + (TCP_MSS - 1)) / (TCP_MSS))
+#define TCP_SNDLOWAT                    (16 * TCP_MSS)
+
+#endif /* MACGYVERNET_SERVER_PROFILE */
+
 /*
    ------------------------------------
    ---------- Memory options ----------
@@ -74,7 +138,9 @@
  * MEM_SIZE: the size of the heap memory. If the application will send
  * a lot of data that needs to be copied, this should be set high.
  */
+#ifndef MEM_SIZE
 #define MEM_SIZE                        1600
+#endif
 
 /*
    ------------------------------------------------
@@ -85,8 +151,13 @@
  * MEMP_NUM_PBUF: the number of memp struct pbufs (used for PBUF_ROM and PBUF_REF).
  * If the application sends a lot of data out of ROM (or other static memory),
  * this should be set high.
+ *
+ * We hand client data to tcp_write() without copying, so every queued
+ * TCP segment needs one of these.
  */
-#define MEMP_NUM_PBUF                   16
+#ifndef MEMP_NUM_PBUF
+#define MEMP_NUM_PBUF                   64
+#endif
 
 /**
  * MEMP_NUM_RAW_PCB: Number of raw connection PCBs
@@ -98,14 +169,20 @@
  * MEMP_NUM_UDP_PCB: the number of UDP protocol control blocks. One
  * per active UDP "connection".
  * (requires the LWIP_UDP option)
+ *
+ * We need one for DNS and one per SOCKS UDP association.
  */
-#define MEMP_NUM_UDP_PCB                4
+#ifndef MEMP_NUM_UDP_PCB
+#define MEMP_NUM_UDP_PCB                16
+#endif
 
 /**
  * MEMP_NUM_TCP_PCB: the number of simulatenously active TCP connections.
  * (requires the LWIP_TCP option)
  */
+#ifndef MEMP_NUM_TCP_PCB
 #define MEMP_NUM_TCP_PCB                4
+#endif
 
 /**
  * MEMP_NUM_TCP_PCB_LISTEN: the number of listening TCP connections.
@@ -117,7 +194,9 @@
  * MEMP_NUM_TCP_SEG: the number of simultaneously queued TCP segments.
  * (requires the LWIP_TCP option)
  */
+#ifndef MEMP_NUM_TCP_SEG
 #define MEMP_NUM_TCP_SEG                16
+#endif
 
 /**
  * MEMP_NUM_REASSDATA: the number of simultaneously IP packets queued for
@@ -168,7 +247,9 @@
 /**
  * PBUF_POOL_SIZE: the number of buffers in the pbuf pool. 
  */
+#ifndef PBUF_POOL_SIZE
 #define PBUF_POOL_SIZE                  8
+#endif
 
 /*
    ---------------------------------
@@ -358,6 +439,12 @@
  */
 #define PBUF_POOL_BUFSIZE               LWIP_MEM_ALIGN_SIZE(TCP_MSS+40+PBUF_LINK_HLEN)
 
+/**
+ * LWIP_SUPPORT_CUSTOM_PBUF==1: Allow pbufs with application-provided
+ * memory. The UDP relay sends client datagrams from its own buffers.
+ */
+#define LWIP_SUPPORT_CUSTOM_PBUF        1
+
 /*
    ------------------------------------
    ---------- LOOPIF options ----------
@@ -389,6 +476,18 @@
  */
 #define LWIP_SOCKET                     0
 
+/*
+   --------------------------------------
+   ---------- Checksum options ----------
+   --------------------------------------
+*/
+/**
+ * LWIP_CHECKSUM_ON_COPY==1: Calculate the checksum while copying data
+ * into pbufs, e.g. for tcp_write() with TCP_WRITE_FLAG_COPY. lwIP uses
+ * LWIP_CHKSUM_COPY from arch/cc.h for this.
+ */
+#define LWIP_CHECKSUM_ON_COPY           1
+
 /*
    ----------------------------------------
    ---------- Statistics options ----------
@@ -396,8 +495,21 @@
 */
 /**
  * LWIP_STATS==1: Enable statistics collection in lwip_stats.
- */
-#define LWIP_STATS                      0
+ *
+ * We only collect memory statistics. They are exported by metrics.cpp.
+ */
+#define LWIP_STATS                      1
+#define LWIP_STATS_DISPLAY              0
+#define MEM_STATS                       1
+#define MEMP_STATS                      1
+#define LINK_STATS                      0
+#define ETHARP_STATS                    0
+#define IP_STATS                        0
+#define IPFRAG_STATS                    0
+#define ICMP_STATS                      0
+#define UDP_STATS                       0
+#define TCP_STATS                       0
+#define SYS_STATS                       0
 /*
    ---------------------------------
    ---------- PPP options ----------
@@ -3,6 +3,10 @@
 #define ASIO_CB_SHARED(self, method) [this, self] (const asio::error_code &error, size_t len) { method(error, len); }
 #define ASIO_CB(method)              [this]       (const asio::error_code &error, size_t len) { method(error, len); }
 
+/// Pick the backend and open what has to exist before the shards are
+/// forked. Pass it to start_shards().
+void prepare_backend();
+
 void initialize_backend(asio::io_service &io);
 
 // EOF
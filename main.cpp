@@ -1,32 +1,146 @@
+#include <netinet/in.h>
+#include <linux/netfilter_ipv4.h>
+
 #include <iostream>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <algorithm>
+#include <unordered_set>
 #include <asio.hpp>
 #include <glog/logging.h>
+#include <gflags/gflags.h>
 
 #include <lwip/tcpip.h>
 #include <lwip/tcp.h>
+#include <lwip/tcp_impl.h>
 
 #include "macgyvernet.hpp"
+#include "trace.hpp"
+#include "buffer_pool.hpp"
+#include "metrics.hpp"
+#include "io_threads.hpp"
+#include "spsc_queue.hpp"
+#include "shard.hpp"
+#include "resolver.hpp"
+#include "udp_relay.hpp"
+#include "splice_relay.hpp"
+#include "routes.hpp"
+#include "vpn_env.hpp"
 #include "logo.hpp"
 
 using asio::ip::tcp;
 
+DEFINE_int32(transparent_port, 0, "Also accept connections that iptables redirected to this port and connect them to their original destination without a SOCKS handshake. 0 disables this. With REDIRECT in the OUTPUT chain, exclude our own direct connections from the rule with --direct_mark or an owner match");
+DEFINE_bool(optimistic_connect, false, "Send the CONNECT reply before lwIP has connected, so the client can send its request right away. If the connect fails, the client sees a reset");
+DEFINE_bool(tproxy, false, "Connections to --transparent_port come from an iptables TPROXY rule instead of REDIRECT. Needs CAP_NET_ADMIN");
+
 class SocksClient final : public std::enable_shared_from_this<SocksClient>
 {
   using self_t = std::shared_ptr<SocksClient>;
 
-  asio::io_service &io_service;
+  // A connection is split between two threads. The client side owns
+  // the socket to the SOCKS client: it does the handshake and copies
+  // payload from and to the kernel. It runs on client_io, which
+  // belongs to one of the I/O threads. The lwIP side does everything
+  // that touches lwIP and runs on lwip_io. Without I/O threads, both
+  // are the same io_service.
+  //
+  // Payload goes from one side to the other through SPSC queues. The
+  // side that pushes posts a wakeup to the other side, unless one is
+  // pending already. Rarer events, such as a finished connect or an
+  // EOF, are posted directly. Members below are grouped by the side
+  // that may touch them.
+
+  asio::io_service &lwip_io;
+  asio::io_service &client_io;
+
+  // ----- Shared by both sides -----
+
+  /// Client data lwIP should send. The client side keeps the buffer
+  /// alive until the remote end has acknowledged the data.
+  struct Chunk {
+    uint8_t const *data;
+    size_t         len;
+  };
+
+  enum {
+    UPSTREAM_QUEUE_SIZE = 64,
+
+    // pbuf chains the client side may hold at the same time.
+    DOWNSTREAM_QUEUE_SIZE = 256,
+
+    // Client data that is read, but not acknowledged by the remote
+    // end yet. We stop reading from the client beyond that.
+    MAX_UNACKED_BYTES = TCP_SND_BUF,
+
+    // With --optimistic_connect, client data we take before the
+    // remote end has accepted the connection.
+    MAX_EARLY_DATA_BYTES = 64 << 10,
+  };
+
+  SpscQueue<Chunk>  upstream_queue   { UPSTREAM_QUEUE_SIZE };    // client side -> lwIP side
+  SpscQueue<pbuf *> downstream_queue { DOWNSTREAM_QUEUE_SIZE };  // lwIP side -> client side
+  SpscQueue<pbuf *> written_queue    { DOWNSTREAM_QUEUE_SIZE };  // client side -> lwIP side
+
+  // Bytes the remote end has acknowledged. Only grows.
+  std::atomic<uint64_t> acked_total { 0 };
+
+  // Set while a wakeup is posted to that side and has not run yet.
+  std::atomic<bool> lwip_wakeup_pending   { false };
+  std::atomic<bool> client_wakeup_pending { false };
+
+  // Set by the client side when it stops reading, because the
+  // upstream queue is full or too much data is unacknowledged. The
+  // lwIP side wakes it up when that changes.
+  std::atomic<bool> upstream_blocked { false };
+
+  // Bytes read from and written to the SOCKS client. Only the client
+  // side counts, /connections reads them.
+  Counter bytes_upstream;
+  Counter bytes_downstream;
+
+  // ----- Client side -----
 
   // This is the socket that is connected to the SOCKS client;
   tcp::socket socket;
 
-  // lwIP's connection identifier.
-  struct tcp_pcb *tcp_pcb = nullptr;
+  /// Client data that lwIP references without having copied it and
+  /// that the remote end has not acknowledged yet.
+  class UnackedData {
+    std::deque<std::pair<BufferPool::Ref, size_t>> chunks;
 
-  struct PointerWrap {
-    std::shared_ptr<SocksClient> ptr;
+  public:
+
+    bool empty() const { return chunks.empty(); }
+
+    void push(BufferPool::Ref const &buf, size_t len)
+    {
+      if (not chunks.empty() and chunks.back().first == buf) {
+        chunks.back().second += len;
+      } else {
+        chunks.emplace_back(buf, len);
+      }
+    }
+
+    /// Drop references to buffers that are completely acknowledged.
+    void ack(size_t len)
+    {
+      while (len and not chunks.empty()) {
+        auto &front = chunks.front();
+
+        if (front.second > len) {
+          front.second -= len;
+          return;
+        }
+
+        len -= front.second;
+        chunks.pop_front();
+      }
+    }
   };
 
-  PointerWrap *tcp_pcb_arg = nullptr;
+  UnackedData unacked;
 
   enum {
     // We need to read this many bytes from a commmand to figure out
@@ -35,6 +149,12 @@ class SocksClient final : public std::enable_shared_from_this<SocksClient>
 
     // At this position in a command packet does the address start.
     ADDRESS_START_OFFSET = 4,
+
+    // The shortest command packet has an empty domain name.
+    MIN_COMMAND_BYTES = INITIAL_COMMAND_BYTES + 2,
+
+    // The longest command packet has a 255 byte domain name.
+    MAX_HANDSHAKE_BYTES = ADDRESS_START_OFFSET + 1 + 255 + 2,
   };
 
   enum VERSION : uint8_t {
@@ -58,160 +178,1293 @@ class SocksClient final : public std::enable_shared_from_this<SocksClient>
     IPV6       = 4,
   };
 
-  // Contains incoming packet data
-  std::array<uint8_t, 1 << 16> rcv_buffer;
+  // Contains the SOCKS handshake. The first handshake_fill bytes are
+  // used. Once the greeting is processed, the command starts at the
+  // beginning.
+  std::array<uint8_t, MAX_HANDSHAKE_BYTES> handshake_buffer;
+  size_t handshake_fill = 0;
+
+  bool greeting_done = false;
+
+  // If true, the method reply has not been sent yet. It goes out in
+  // front of the command reply then.
+  bool method_reply_pending = false;
+
+  // Client data is read into pool buffers and lwIP sends it from there
+  // without copying. upstream_fill bytes of upstream_buffer are used.
+  //
+  // We only hold a buffer while there is data in it that lwIP has
+  // not acknowledged.
+  BufferPool::Ref upstream_buffer;
+  size_t          upstream_fill = 0;
+
+  // Bytes read from the client and how much of acked_total unacked
+  // has seen.
+  uint64_t upstream_read  = 0;
+  uint64_t upstream_acked = 0;
 
   // IF true, an async_read is in progress.
   bool async_read_in_progress = false;
 
-  // Set to true, if tcp_close was called.
-  bool close_in_progress = false;
+  // pbuf chains from the lwIP side that are not yet written to the
+  // SOCKS client.
+  std::vector<pbuf *> downstream_pending;
+
+  // pbuf chains that are part of the async_write in progress. They
+  // only go back to the lwIP side when the write is done.
+  std::vector<pbuf *> downstream_in_flight;
+  size_t              downstream_in_flight_bytes = 0;
+
+  // Scatter-gather list pointing directly into downstream_in_flight.
+  std::vector<asio::const_buffer> downstream_gather_list;
+
+  // If true, an async_write of pbuf data is in progress.
+  bool async_write_in_progress = false;
+
+  // We must not write any payload before the CONNECT response.
+  bool connect_response_sent = false;
+
+  // Set for connections from the transparent listener. They have no
+  // handshake and get no CONNECT response.
+  bool transparent = false;
+
+  // Set when the CONNECT response went out before the connection was
+  // up. See may_reply_early().
+  bool optimistic = false;
+
+  // Set when the lwIP side or the direct relay has connected.
+  bool remote_connected = false;
+
+  // When the connection was accepted. For handshake duration metrics.
+  std::chrono::steady_clock::time_point accepted;
+
+  // Set when the remote end or the SOCKS client have closed their
+  // sending direction.
+  bool remote_eof = false;
+  bool client_eof = false;
+
+  // Set when the socket is closed. From then on, the lwIP side
+  // consumes downstream_queue.
+  bool client_closed = false;
+  bool client_aborted = false;
+
+  // For destinations outside the VPN. Relays between socket and a
+  // kernel socket to the destination instead of lwIP.
+  std::shared_ptr<SpliceRelay> direct_relay;
+
+  // ----- lwIP side -----
+
+  Resolver &resolver;
+
+  // lwIP's connection identifier.
+  struct tcp_pcb *tcp_pcb = nullptr;
+
+  struct PointerWrap {
+    std::shared_ptr<SocksClient> ptr;
+  };
+
+  PointerWrap *tcp_pcb_arg = nullptr;
+
+  // Bytes given to tcp_write and bytes the remote end acknowledged.
+  uint64_t upstream_written    = 0;
+  uint64_t upstream_lwip_acked = 0;
+
+  // pbuf chains that went to the client side and have not come back
+  // through written_queue. At most DOWNSTREAM_QUEUE_SIZE, so
+  // written_queue never overflows. lwIP's data beyond that waits in
+  // downstream_backlog.
+  size_t             downstream_outstanding = 0;
+  std::deque<pbuf *> downstream_backlog;
+
+  // Set when the client's EOF has arrived. It is passed on to lwIP
+  // once upstream_queue is empty, which sets upstream_shut.
+  bool upstream_eof  = false;
+  bool upstream_shut = false;
+
+  // The remote end's EOF. The client side only learns about it, once
+  // downstream_backlog is empty, so it comes after the data.
+  bool remote_eof_seen   = false;
+  bool remote_eof_posted = false;
+
+  // Set when lwIP has connected. Client data waits in upstream_queue
+  // until then.
+  bool lwip_connected = false;
+
+  // Set when tcp_close was called. lwIP keeps sending from our
+  // buffers until everything is acknowledged.
+  bool pcb_closing = false;
+
+  // Set when lwIP doesn't reference our buffers or call us anymore.
+  bool lwip_released = false;
+
+  // Set when the client side has closed the socket.
+  bool client_gone = false;
+
+  // Set when the destination is outside the VPN and lwIP is not
+  // involved.
+  bool direct = false;
+
+  // For UDP ASSOCIATE. Lives as long as the TCP connection.
+  std::shared_ptr<UdpRelay> udp_relay;
+
+  // The SOCKS client and where it wanted to go. For introspection.
+  std::string peer;
+  std::string destination;
+
+  // All connections whose client side is open.
+  static std::unordered_set<SocksClient *> live;
+
+  static const char *command_string(COMMAND c)
+  {
+    switch (c) {
+    case CONNECT:       return "CONNECT";
+    case BIND:          return "BIND";
+    case UDP_ASSOCIATE: return "UDP";
+    default:            return "unknown";
+    }
+  }
+
+  static const char *address_type_string(ADDRESS_TYPE t)
+  {
+    switch (t) {
+    case IPV4:       return "IPv4";
+    case DOMAINNAME: return "domain name";
+    case IPV6:       return "IPv6";
+    default:         return "unknown";
+    }
+  }
+
+  // ----- Client side -----
+
+  void wake_lwip()
+  {
+    if (not lwip_wakeup_pending.exchange(true)) {
+      auto self = shared_from_this();
+      lwip_io.post([this, self] { lwip_wakeup(); });
+    }
+  }
+
+  /// Close the socket to the SOCKS client. abort is true, if the
+  /// connection failed and the remote end should see a reset.
+  void client_close(bool abort)
+  {
+    if (client_closed) {
+      return;
+    }
+
+    client_closed  = true;
+    client_aborted = abort;
+
+    // After a success response, an orderly close would look like the
+    // remote end closing the connection. Make it a reset. Redirected
+    // connections look established to the application from the start.
+    if (abort and (connect_response_sent or transparent)) {
+      asio::error_code ec;
+      socket.set_option(tcp::socket::linger(true, 0), ec);
+    }
+
+    if (direct_relay) {
+      direct_relay->close();
+    }
+
+    asio::error_code ec;
+    socket.close(ec);
+
+    // Otherwise, downstream_written_cb finishes.
+    if (not async_write_in_progress) {
+      client_finish();
+    }
+  }
+
+  /// The socket is closed and no write is in progress anymore. Give
+  /// everything to the lwIP side.
+  void client_finish()
+  {
+    for (pbuf *p : downstream_pending) {
+      written_queue.push(p);
+    }
+    downstream_pending.clear();
+
+    release_upstream_buffer();
+
+    auto self  = shared_from_this();
+    bool abort = client_aborted;
+    lwip_io.post([this, self, abort] { lwip_client_closed(abort); });
+  }
+
+  /// Posted by the lwIP side, when lwIP doesn't send from our buffers
+  /// anymore.
+  void client_lwip_gone(bool error)
+  {
+    unacked = UnackedData();
+    release_upstream_buffer();
+
+    if (error) {
+      client_close(true);
+    }
+  }
+
+  /// Posted by the lwIP side, when there are pbufs in
+  /// downstream_queue or room for client data.
+  void client_wakeup()
+  {
+    client_wakeup_pending = false;
+
+    process_acks();
+
+    if (client_closed) {
+      return;
+    }
+
+    pbuf *p;
+    while (downstream_queue.pop(p)) {
+      downstream_pending.push_back(p);
+    }
+
+    flush_downstream();
+    upstream_progress();
+  }
+
+  /// Drop our references to client data the remote end has
+  /// acknowledged.
+  void process_acks()
+  {
+    uint64_t acked = acked_total.load(std::memory_order_acquire);
+
+    unacked.ack(acked - upstream_acked);
+    upstream_acked = acked;
+
+    release_upstream_buffer();
+  }
+
+  bool upstream_has_room() const
+  {
+    return not upstream_queue.full() and
+      upstream_read - acked_total.load(std::memory_order_acquire) < MAX_UNACKED_BYTES and
+      (remote_connected or upstream_read < MAX_EARLY_DATA_BYTES);
+  }
+
+  /// Wait for data from the SOCKS client, as long as the lwIP side
+  /// can take it.
+  void upstream_progress()
+  {
+    if (async_read_in_progress or client_eof or client_closed or not connect_response_sent) {
+      return;
+    }
+
+    if (not upstream_has_room()) {
+      upstream_blocked = true;
+
+      // The lwIP side may have made room before it could see the flag.
+      // Pairs with the fence in unblock_upstream().
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+
+      if (not upstream_has_room()) {
+        TRACE << "lwIP side is full. Waiting for it.";
+        return;
+      }
+
+      upstream_blocked = false;
+    }
+
+    // We only take a buffer from the pool, when there actually is
+    // something to read.
+    auto self = shared_from_this();
+    async_read_in_progress = true;
+    socket.async_read_some(asio::null_buffers(), ASIO_CB_SHARED(self, client_readable_cb));
+  }
+
+  void client_readable_cb(const asio::error_code &error, size_t)
+  {
+    async_read_in_progress = false;
+
+    if (client_closed) {
+      TRACE << "Stop waiting for data from SOCKS client.";
+      return;
+    }
+
+    if (error) {
+      LOG(ERROR) << "Error while waiting for data from SOCKS client: " << error.message();
+      client_close(true);
+      return;
+    }
+
+    process_acks();
+
+    if (not upstream_buffer or upstream_fill == upstream_buffer.size()) {
+      upstream_buffer = buffer_pool().get();
+      upstream_fill   = 0;
+    }
+
+    // Read as many bytes as lwIP will take.
+    size_t room   = MAX_UNACKED_BYTES - (upstream_read - upstream_acked);
+
+    if (not remote_connected) {
+      room = std::min<size_t>(room, MAX_EARLY_DATA_BYTES - upstream_read);
+    }
+    size_t buflen = std::min<size_t>(upstream_buffer.size() - upstream_fill, room);
+
+    asio::error_code ec;
+    size_t len = socket.read_some(asio::buffer(upstream_buffer.data() + upstream_fill, buflen), ec);
+
+    if (ec == asio::error_code(asio::error::would_block)) {
+      // Spurious wakeup.
+      upstream_progress();
+      return;
+    }
+
+    if (ec == asio::error_code(asio::error::misc_errors::eof)) {
+      LOG(INFO) << "EOF from SOCKS client.";
+      client_eof = true;
+
+      auto self = shared_from_this();
+      lwip_io.post([this, self] { lwip_client_eof(); });
+
+      if (downstream_done()) {
+        client_close(false);
+      }
+      return;
+    }
+
+    if (ec) {
+      LOG(ERROR) << "Error while receiving data from SOCKS client: " << ec.message();
+      client_close(true);
+      return;
+    }
+
+    TRACE << "Received " << len << " bytes from SOCKS client.";
+
+    // There is room, upstream_progress checked.
+    upstream_queue.push({ upstream_buffer.data() + upstream_fill, len });
+    unacked.push(upstream_buffer, len);
+
+    upstream_fill += len;
+    upstream_read += len;
+    bytes_upstream.add(len);
+
+    wake_lwip();
+    upstream_progress();
+  }
+
+  /// Give the upstream buffer back to the pool, if lwIP doesn't need
+  /// it anymore.
+  void release_upstream_buffer()
+  {
+    if (upstream_buffer.unique()) {
+      upstream_buffer.reset();
+      upstream_fill = 0;
+    }
+  }
+
+  /// Posted by the lwIP side, when the connection is up.
+  void client_connected()
+  {
+    if (client_closed) {
+      return;
+    }
+
+    remote_connected = true;
+
+    if (optimistic) {
+      // The response is out already. Early data may wait for this.
+      upstream_progress();
+      return;
+    }
+
+    send_connect_response();
+  }
+
+  void send_connect_response()
+  {
+    if (transparent) {
+      connect_success_written_cb(asio::error_code(), 0);
+      return;
+    }
+
+    static char connect_response[10] = { SOCKS_VERSION, 0 };
+
+    std::array<asio::const_buffer, 2> reply {{
+        pending_method_reply(),
+        asio::buffer(connect_response, sizeof(connect_response)) }};
+
+    auto self = shared_from_this();
+    asio::async_write(socket, reply, ASIO_CB_SHARED(self, connect_success_written_cb));
+  }
+
+  void connect_success_written_cb(const asio::error_code &error, size_t)
+  {
+    if (error) {
+      LOG(ERROR) << "Error while sending CONNECT response: " << error.message();
+      client_close(true);
+      return;
+    }
+
+    connect_response_sent = true;
+    metrics().handshake_done(std::chrono::steady_clock::now() - accepted);
+
+    if (direct_relay) {
+      auto self = shared_from_this();
+      direct_relay->start([this, self] (asio::error_code const &error) {
+          if (error) {
+            LOG(ERROR) << "Direct connection failed: " << error.message();
+          } else {
+            LOG(INFO) << "Direct connection closed.";
+          }
+
+          client_close(bool(error));
+        });
+      return;
+    }
+
+    // The remote end might have been faster than us.
+    flush_downstream();
+
+    // Wait for data.
+    upstream_progress();
+  }
+
+  /// Posted by the lwIP side for destinations outside the VPN.
+  void client_connect_direct(tcp::endpoint destination)
+  {
+    if (client_closed) {
+      return;
+    }
+
+    metrics().direct_connections++;
+    direct_relay = SpliceRelay::create(client_io, socket, bytes_upstream, bytes_downstream);
+
+    auto self = shared_from_this();
+    direct_relay->connect(destination, [this, self] (asio::error_code const &error) {
+        if (error) {
+          LOG(ERROR) << "Direct connection failed: " << error.message();
+          client_close(true);
+          return;
+        }
+
+        LOG(INFO) << "Connected directly.";
+        client_connected();
+      });
+  }
+
+  /// Posted by the lwIP side after the last pbuf from the remote end.
+  void client_remote_eof()
+  {
+    remote_eof = true;
+
+    if (client_closed) {
+      return;
+    }
+
+    pbuf *p;
+    while (downstream_queue.pop(p)) {
+      downstream_pending.push_back(p);
+    }
+
+    flush_downstream();
+  }
+
+  /// True, if the remote end has closed the connection and everything
+  /// it sent has reached the SOCKS client.
+  bool downstream_done() const
+  {
+    return remote_eof and not async_write_in_progress and downstream_pending.empty();
+  }
+
+  /// Write all pending pbufs to the SOCKS client with a single
+  /// gathering write. If there is nothing left to write and the
+  /// remote end is gone, pass the EOF on to the client.
+  void flush_downstream()
+  {
+    if (async_write_in_progress or not connect_response_sent or client_closed) {
+      return;
+    }
+
+    if (downstream_pending.empty()) {
+      if (remote_eof) {
+        LOG(INFO) << "Remote end closed connection. Forwarding EOF.";
+
+        asio::error_code ec;
+        socket.shutdown(tcp::socket::shutdown_send, ec);
+
+        if (client_eof) {
+          client_close(false);
+        }
+      }
+      return;
+    }
+
+    // Both vectors keep their capacity, so there are no allocations
+    // here once the connection is up to speed.
+    std::swap(downstream_pending, downstream_in_flight);
+    downstream_gather_list.clear();
+
+    for (pbuf *p : downstream_in_flight) {
+      downstream_in_flight_bytes += p->tot_len;
+
+      for (pbuf *c = p; c; c = c->next) {
+        downstream_gather_list.emplace_back(c->payload, c->len);
+      }
+    }
+
+    auto self = shared_from_this();
+    async_write_in_progress = true;
+    asio::async_write(socket, downstream_gather_list,
+                      ASIO_CB_SHARED(self, downstream_written_cb));
+  }
+
+  void downstream_written_cb(const asio::error_code &error, size_t)
+  {
+    async_write_in_progress = false;
+
+    // The lwIP side frees them and opens the receive window by as
+    // much. There is room, because it never has more pbufs out than
+    // the queue holds.
+    for (pbuf *p : downstream_in_flight) {
+      written_queue.push(p);
+    }
+    downstream_in_flight.clear();
+
+    bytes_downstream.add(downstream_in_flight_bytes);
+    downstream_in_flight_bytes = 0;
+
+    if (client_closed) {
+      client_finish();
+      return;
+    }
+
+    wake_lwip();
+
+    if (error) {
+      LOG(ERROR) << "Error while sending data to SOCKS client: " << error.message();
+      client_close(true);
+      return;
+    }
+
+    flush_downstream();
+  }
+
+  void handle_connect_by_name()
+  {
+    size_t name_len = handshake_buffer.at(ADDRESS_START_OFFSET);
+    const char *n = reinterpret_cast<const char *>(handshake_buffer.data() + ADDRESS_START_OFFSET + 1);
+    std::string name (n, name_len);
+
+    size_t port_offset = ADDRESS_START_OFFSET + 1 + name_len;
+    uint16_t port = handshake_buffer.at(port_offset) << 8 | handshake_buffer.at(port_offset + 1);
+
+    auto self = shared_from_this();
+    lwip_io.post([this, self, name, port] { lwip_connect_by_name(name, port); });
+  }
+
+  void handle_connect_by_ipv4()
+  {
+    ip_addr_t ip_addr;
+
+    memcpy(&ip_addr, handshake_buffer.data() + ADDRESS_START_OFFSET, sizeof(ip_addr.addr));
+
+    uint16_t port = handshake_buffer.at(ADDRESS_START_OFFSET + 4) << 8 | handshake_buffer.at(ADDRESS_START_OFFSET + 5);
+
+    auto self = shared_from_this();
+    lwip_io.post([this, self, ip_addr, port] { lwip_connect_to(ip_addr, port); });
+  }
+
+  /// With --optimistic_connect, we answer CONNECTs before the
+  /// connection is up. Only lwIP takes early data, so this is limited
+  /// to destinations behind the VPN. A name could resolve to a
+  /// direct destination, unless everything goes through the VPN.
+  bool may_reply_early(ADDRESS_TYPE at) const
+  {
+    if (not FLAGS_optimistic_connect) {
+      return false;
+    }
+
+    if (at == ADDRESS_TYPE::IPV4) {
+      uint32_t addr;
+      memcpy(&addr, handshake_buffer.data() + ADDRESS_START_OFFSET, sizeof(addr));
+      return through_vpn(addr);
+    }
+
+    return not split_tunnel_active();
+  }
+
+  void handle_connect()
+  {
+    ADDRESS_TYPE at = ADDRESS_TYPE(handshake_buffer.at(3));
+
+    switch (at) {
+    case ADDRESS_TYPE::DOMAINNAME:
+      handle_connect_by_name();
+      break;
+    case ADDRESS_TYPE::IPV4:
+      handle_connect_by_ipv4();
+      break;
+    default:
+      LOG(ERROR) << "Address type " << at << " not supported.";
+      client_close(true);
+      return;
+    }
+
+    if (may_reply_early(at)) {
+      TRACE << "Replying before the connection is up.";
+      optimistic = true;
+      send_connect_response();
+    }
+  }
+
+  void handle_udp_associate()
+  {
+    asio::error_code ec;
+    auto local  = socket.local_endpoint(ec);
+    auto remote = socket.remote_endpoint(ec);
+
+    if (ec or not local.address().is_v4()) {
+      LOG(ERROR) << "UDP ASSOCIATE is only supported over IPv4.";
+      client_close(true);
+      return;
+    }
+
+    // The client's address and port in the request are only hints
+    // and often zero. The relay takes the port from the first
+    // datagram instead.
+    auto self = shared_from_this();
+    lwip_io.post([this, self, remote, local] {
+        lwip_udp_associate(remote.address(), local.address());
+      });
+  }
+
+  /// Posted by the lwIP side, when the UDP relay is up.
+  void client_udp_ready(asio::ip::udp::endpoint relay)
+  {
+    if (client_closed) {
+      return;
+    }
+
+    auto addr = relay.address().to_v4().to_bytes();
+
+    handshake_buffer[0] = SOCKS_VERSION;
+    handshake_buffer[1] = 0;
+    handshake_buffer[2] = 0;
+    handshake_buffer[3] = IPV4;
+    std::copy(addr.begin(), addr.end(), handshake_buffer.begin() + ADDRESS_START_OFFSET);
+    handshake_buffer[8] = relay.port() >> 8;
+    handshake_buffer[9] = relay.port();
+
+    std::array<asio::const_buffer, 2> reply {{
+        pending_method_reply(), asio::buffer(handshake_buffer, 10) }};
+
+    auto self = shared_from_this();
+    asio::async_write(socket, reply, ASIO_CB_SHARED(self, udp_associate_written_cb));
+  }
+
+  void udp_associate_written_cb(const asio::error_code &error, size_t)
+  {
+    if (error) {
+      LOG(ERROR) << "Error while sending UDP ASSOCIATE response: " << error.message();
+      client_close(true);
+      return;
+    }
+
+    metrics().handshake_done(std::chrono::steady_clock::now() - accepted);
+
+    asio::error_code ec;
+    control_readable_cb(ec, 0);
+  }
+
+  /// The UDP association ends, when the client closes the TCP
+  /// connection. Anything else it sends is ignored.
+  void control_readable_cb(const asio::error_code &error, size_t)
+  {
+    asio::error_code ec = error;
+
+    if (client_closed) {
+      return;
+    }
+
+    while (not ec) {
+      socket.read_some(asio::buffer(handshake_buffer), ec);
+    }
+
+    if (ec == asio::error_code(asio::error::would_block)) {
+      auto self = shared_from_this();
+      socket.async_read_some(asio::null_buffers(), ASIO_CB_SHARED(self, control_readable_cb));
+      return;
+    }
+
+    LOG(INFO) << "UDP association closed.";
+    client_close(false);
+  }
+
+  void handle_command()
+  {
+    COMMAND      cmd = COMMAND(handshake_buffer.at(1));
+    ADDRESS_TYPE at  = ADDRESS_TYPE(handshake_buffer.at(3));
+
+    LOG(INFO) << "Command '" << command_string(cmd) << "' Address '" << address_type_string(at) << "'";
+
+    switch (cmd) {
+    case COMMAND::CONNECT:
+      handle_connect();
+      break;
+
+    case COMMAND::UDP_ASSOCIATE:
+      handle_udp_associate();
+      break;
+
+    default:
+      LOG(ERROR) << "Can't handle command.";
+      client_close(true);
+      break;
+    }
+  }
+
+  /// The length of the command packet in handshake_buffer. Until its
+  /// header is complete, this is the shortest possible length.
+  size_t command_length() const
+  {
+    if (handshake_fill < INITIAL_COMMAND_BYTES) {
+      return MIN_COMMAND_BYTES;
+    }
+
+    switch (ADDRESS_TYPE(handshake_buffer.at(3))) {
+    case IPV4:       return ADDRESS_START_OFFSET + 4 + 2;
+    case DOMAINNAME: return ADDRESS_START_OFFSET + 1 + handshake_buffer.at(4) + 2;
+    case IPV6:       return ADDRESS_START_OFFSET + 16 + 2;
+    default:
+      // Not supported. handle_command() rejects it.
+      return MIN_COMMAND_BYTES;
+    }
+  }
+
+  /// How many bytes of the handshake we can read without reading past
+  /// its end. Anything after the command belongs to the remote end.
+  size_t handshake_bytes_wanted() const
+  {
+    if (greeting_done) {
+      return command_length();
+    }
+
+    // Assume one method until we know. A greeting without methods
+    // is rejected anyway.
+    size_t greeting_len = handshake_fill >= 2 ? 2 + handshake_buffer.at(1) : 3;
+
+    return std::min<size_t>(greeting_len + MIN_COMMAND_BYTES, handshake_buffer.size());
+  }
+
+  /// The method reply, if it still has to go out in front of the
+  /// command reply. Empty otherwise.
+  asio::const_buffer pending_method_reply() const
+  {
+    static uint8_t const method_response[] { SOCKS_VERSION, NO_AUTHENTICATION };
+
+    return asio::buffer(method_response, method_reply_pending ? sizeof(method_response) : 0);
+  }
+
+  /// Process the greeting and command in handshake_buffer, as far as
+  /// they are there. Returns true, if we need more bytes.
+  bool parse_handshake()
+  {
+    if (not greeting_done) {
+      if (handshake_fill < 2) {
+        return true;
+      }
+
+      uint8_t client_version = handshake_buffer.at(0);
+      uint8_t methods        = handshake_buffer.at(1);
+      size_t  greeting_len   = 2 + methods;
+
+      if (client_version != SOCKS_VERSION) {
+        LOG(ERROR) << "Invalid version from client. Disconnecting.";
+        client_close(true);
+        return false;
+      }
+
+      if (handshake_fill < greeting_len) {
+        return true;
+      }
+
+      LOG(INFO) << "Client wants version " << int(client_version) << " with "
+                << int(methods) << " authentication methods.";
+
+      auto begin = handshake_buffer.begin() + 2;
+      if (std::find(begin, begin + methods, NO_AUTHENTICATION) == begin + methods) {
+        LOG(ERROR) << "We don't understand any auth method. Closing connection.";
+        client_close(true);
+        return false;
+      }
+
+      LOG(INFO) << "Selected no authentication.";
+      greeting_done        = true;
+      method_reply_pending = true;
+
+      // The command starts at the beginning of the buffer.
+      handshake_fill -= greeting_len;
+      memmove(handshake_buffer.data(), handshake_buffer.data() + greeting_len, handshake_fill);
+
+      // The method reply waits. If the command came with the
+      // greeting, both replies go out together. Otherwise it is
+      // written, once the socket runs dry.
+    }
+
+    if (handshake_fill < command_length()) {
+      return true;
+    }
+
+    CHECK_EQ(handshake_fill, command_length());
+
+    if (handshake_buffer.at(0) != SOCKS_VERSION) {
+      LOG(ERROR) << "Client specified wrong SOCKS version: " << int(handshake_buffer.at(0));
+      client_close(true);
+      return false;
+    }
+
+    handle_command();
+    return false;
+  }
+
+  void method_written_cb(const asio::error_code &error, size_t)
+  {
+    if (error) {
+      LOG(ERROR) << "Error while sending greeting: " << error;
+      client_close(true);
+      return;
+    }
+
+    method_reply_pending = false;
+    handshake_readable_cb(asio::error_code(), 0);
+  }
+
+  /// Read what the client has sent of the handshake. A greeting and
+  /// command that arrive together are handled in one go.
+  void handshake_readable_cb(const asio::error_code &error, size_t)
+  {
+    if (client_closed) {
+      return;
+    }
+
+    if (error) {
+      LOG(ERROR) << "Error while waiting for handshake: " << error.message();
+      client_close(true);
+      return;
+    }
+
+    for (;;) {
+      size_t wanted = handshake_bytes_wanted();
+      CHECK_LT(handshake_fill, wanted);
+
+      asio::error_code ec;
+      size_t len = socket.read_some(asio::buffer(handshake_buffer.data() + handshake_fill,
+                                                 wanted - handshake_fill), ec);
+
+      if (ec == asio::error_code(asio::error::would_block)) {
+        auto self = shared_from_this();
+
+        if (greeting_done and method_reply_pending) {
+          // The client doesn't pipeline and waits for the reply.
+          asio::async_write(socket, asio::buffer(pending_method_reply()),
+                            ASIO_CB_SHARED(self, method_written_cb));
+          return;
+        }
+
+        socket.async_read_some(asio::null_buffers(), ASIO_CB_SHARED(self, handshake_readable_cb));
+        return;
+      }
+
+      if (ec) {
+        LOG(ERROR) << "Error while receiving handshake: " << ec.message();
+        client_close(true);
+        return;
+      }
+
+      handshake_fill += len;
+
+      if (not parse_handshake()) {
+        return;
+      }
+    }
+  }
+
+  void client_start()
+  {
+    accepted = std::chrono::steady_clock::now();
+    metrics().socks_connections++;
+
+    // All reads from the client are read_some() calls once the socket
+    // is readable.
+    socket.non_blocking(true);
+
+    handshake_readable_cb(asio::error_code(), 0);
+  }
+
+  /// Posted by the lwIP side for a redirected connection, before it
+  /// connects.
+  void client_start_transparent()
+  {
+    accepted    = std::chrono::steady_clock::now();
+    transparent = true;
+    metrics().transparent_connections++;
+
+    socket.non_blocking(true);
+  }
+
+  // ----- lwIP side -----
+
+  void wake_client()
+  {
+    if (not client_wakeup_pending.exchange(true)) {
+      auto self = shared_from_this();
+      client_io.post([this, self] { client_wakeup(); });
+    }
+  }
+
+  /// Posted by the client side, when there is data in upstream_queue
+  /// or in written_queue.
+  void lwip_wakeup()
+  {
+    lwip_wakeup_pending = false;
+
+    free_written();
+    upstream_lwip_progress();
+  }
+
+  /// Free pbufs the client side has written and only now open the
+  /// receive window again. This way the remote end cannot send faster
+  /// than the SOCKS client reads.
+  void free_written()
+  {
+    size_t written = 0;
+    pbuf *p;
+
+    while (written_queue.pop(p)) {
+      written += p->tot_len;
+      pbuf_free(p);
+      downstream_outstanding--;
+    }
+
+    while (tcp_pcb and written) {
+      uint16_t chunk = std::min<size_t>(written, 0xFFFF);
+      tcp_recved(tcp_pcb, chunk);
+      written -= chunk;
+    }
+
+    push_downstream_backlog();
+  }
+
+  void push_downstream_backlog()
+  {
+    bool pushed = false;
+
+    while (not downstream_backlog.empty() and downstream_outstanding < DOWNSTREAM_QUEUE_SIZE) {
+      downstream_queue.push(downstream_backlog.front());
+      downstream_backlog.pop_front();
+      downstream_outstanding++;
+      pushed = true;
+    }
+
+    if (pushed) {
+      wake_client();
+    }
+
+    if (remote_eof_seen and downstream_backlog.empty()) {
+      post_remote_eof();
+    }
+  }
+
+  void post_remote_eof()
+  {
+    if (remote_eof_posted or client_gone) {
+      return;
+    }
+
+    remote_eof_posted = true;
+
+    auto self = shared_from_this();
+    client_io.post([this, self] { client_remote_eof(); });
+  }
+
+  /// Hand client data from upstream_queue to lwIP, as far as lwIP's
+  /// send buffer allows. This is called again when the remote end
+  /// ACKs data.
+  void upstream_lwip_progress()
+  {
+    // lwIP would send data segments without ACK in SYN_SENT and close
+    // the connection on an early shutdown, so early data waits here.
+    if (not tcp_pcb or not lwip_connected or upstream_shut) {
+      return;
+    }
+
+    bool written = false;
+
+    while (Chunk *chunk = upstream_queue.front()) {
+      size_t len = std::min<size_t>({ chunk->len, tcp_sndbuf(tcp_pcb), 0xFFFF });
+
+      if (len == 0) {
+        TRACE << "Send buffer full. Waiting for ACKs.";
+        break;
+      }
+
+      // No copy. The data stays in the client side's buffer until it
+      // is ACK'd.
+      err_t err = tcp_write(tcp_pcb, chunk->data, len, 0);
+      if (err == ERR_MEM) {
+        TRACE << "lwIP send queue is full. Retrying when data is ACK'd.";
+        break;
+      } else if (err != ERR_OK) {
+        LOG(ERROR) << "Couldn't send. tcp_write() returned: " << int(err);
+        lwip_abort();
+        return;
+      }
+
+      written = true;
+      upstream_written += len;
+
+      chunk->data += len;
+      chunk->len  -= len;
+
+      if (chunk->len == 0) {
+        upstream_queue.pop();
+      }
+    }
+
+    if (written) {
+      tcp_output(tcp_pcb);
+      unblock_upstream();
+    }
+
+    if (upstream_eof and not upstream_queue.front()) {
+      if (remote_eof_seen) {
+        LOG(INFO) << "EOF. Closing connection.";
+        lwip_close();
+      } else {
+        // The remote end may still have data for the client. Only
+        // close our sending direction.
+        LOG(INFO) << "EOF. Shutting down sending direction.";
+        upstream_shut = true;
+        tcp_shutdown(tcp_pcb, 0, 1);
+      }
+    }
+  }
 
-  static const char *command_string(COMMAND c)
+  /// Wake the client side, if it waits for room.
+  void unblock_upstream()
   {
-    switch (c) {
-    case CONNECT:       return "CONNECT";
-    case BIND:          return "BIND";
-    case UDP_ASSOCIATE: return "UDP";
-    default:            return "unknown";
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (upstream_blocked.load(std::memory_order_relaxed) and upstream_blocked.exchange(false)) {
+      wake_client();
     }
   }
 
-  static const char *address_type_string(ADDRESS_TYPE t)
+  /// Posted by the client side after its last data.
+  void lwip_client_eof()
   {
-    switch (t) {
-    case IPV4:       return "IPv4";
-    case DOMAINNAME: return "domain name";
-    case IPV6:       return "IPv6";
-    default:         return "unknown";
-    }
+    upstream_eof = true;
+    upstream_lwip_progress();
   }
 
-  void handle_connect_by_name()
+  /// Posted by the client side, when it has closed the socket. From
+  /// now on, we consume downstream_queue.
+  void lwip_client_closed(bool abort)
   {
+    client_gone = true;
+    live.erase(this);
 
-    const char *n = reinterpret_cast<const char *>(rcv_buffer.data() + ADDRESS_START_OFFSET + 1);
-    std::string name (n, rcv_buffer.at(ADDRESS_START_OFFSET));
-    LOG(INFO) << "Name: " << name;
+    pbuf *p;
+    while (downstream_queue.pop(p)) {
+      pbuf_free(p);
+      downstream_outstanding--;
+    }
+
+    for (pbuf *b : downstream_backlog) {
+      pbuf_free(b);
+    }
+    downstream_backlog.clear();
+
+    free_written();
 
-    LOG(ERROR) << "XXX Implement connect by name";
+    if (udp_relay) {
+      udp_relay->close();
+      udp_relay.reset();
+    }
+
+    if (abort) {
+      lwip_abort();
+    }
   }
 
-  void connection_close()
+  /// Both directions have seen EOF. lwIP keeps the PCB until the
+  /// remote end has acknowledged everything and keeps calling us
+  /// until then.
+  void lwip_close()
   {
     assert(tcp_pcb);
 
-    tcp_arg (tcp_pcb, nullptr);
-    tcp_err (tcp_pcb, nullptr);
-    tcp_sent(tcp_pcb, nullptr);
+    auto pcb = tcp_pcb;
+    tcp_pcb     = nullptr;
+    pcb_closing = true;
 
-    auto old_tcp_pcb = tcp_pcb;
-    tcp_pcb = nullptr;
+    tcp_recv(pcb, nullptr);
 
-    /// XXX How do we make sure that noone touches rcv_buffer after
-    /// this SocksClient instance has been destroyed?
-    tcp_close(old_tcp_pcb);
+    bool all_acked = upstream_lwip_acked == upstream_written;
+
+    if (all_acked) {
+      tcp_arg (pcb, nullptr);
+      tcp_err (pcb, nullptr);
+      tcp_sent(pcb, nullptr);
+    }
+
+    if (tcp_close(pcb) != ERR_OK) {
+      LOG(ERROR) << "tcp_close failed. Aborting connection.";
+      pcb_closing = false;
+
+      tcp_arg(pcb, nullptr);
+      tcp_err(pcb, nullptr);
+      tcp_abort(pcb);
+
+      lwip_release(true);
+      return;
+    }
 
-    close_in_progress = true;
-    socket.cancel();
-    socket.close();
+    if (all_acked) {
+      lwip_release(false);
+    }
   }
 
-  /// Same as connection_hard_abort, but can be used in the
-  /// destructor.
-  void _connection_hard_abort()
+  /// Tells lwIP to abort the connection, unless it is closing anyway.
+  /// If this is called from lwip event handlers the return value
+  /// needs to be ERR_ABRT to prevent double frees.
+  void lwip_abort()
   {
-    asio::error_code ec { asio::error::operation_aborted };
-    socket.close(ec);
+    if (pcb_closing) {
+      return;
+    }
 
     if (tcp_pcb) {
       auto pcb = tcp_pcb;
       tcp_pcb = nullptr;
+
+      // Otherwise tcp_abort calls lwip_err_cb.
+      tcp_arg(pcb, nullptr);
+      tcp_err(pcb, nullptr);
       tcp_abort(pcb);
     }
 
-    auto *arg = tcp_pcb_arg;
-    if (arg) {
-      tcp_pcb_arg = nullptr;
-      delete arg;
-    }
+    lwip_release(true);
+  }
 
+  /// True, if we have aborted the PCB. lwIP callbacks then have to
+  /// return ERR_ABRT.
+  bool lwip_aborted() const
+  {
+    return not tcp_pcb and not pcb_closing;
   }
 
-  /// Tells lwIP to abort the connection. If this is called from lwip
-  /// event handlers the return value needs to be ERR_ABRT to prevent
-  /// double frees.
-  void connection_hard_abort()
+  /// lwIP doesn't reference our buffers or call us anymore. The client
+  /// side can drop its buffers and, if error is true, close the
+  /// socket.
+  void lwip_release(bool error)
   {
-    // Protect `this' from disappearing.
-    auto sthis = shared_from_this();
-    _connection_hard_abort();
+    if (lwip_released) {
+      return;
+    }
+
+    lwip_released = true;
+
+    // tcp_pcb_arg may hold the last reference.
+    auto self = shared_from_this();
+
+    delete tcp_pcb_arg;
+    tcp_pcb_arg = nullptr;
+
+    client_io.post([this, self, error] { client_lwip_gone(error); });
   }
 
-  void data_received_cb(const asio::error_code &error, size_t len)
+  void lwip_connect_by_name(std::string const &name, uint16_t port)
   {
-    async_read_in_progress = false;
+    LOG(INFO) << "Resolving " << name;
+    destination = name + ":" + std::to_string(port);
 
-    LOG(INFO) << "Received " << len << " bytes from SOCKS client. sndbuf is " << tcp_sndbuf(tcp_pcb);
+    auto self = shared_from_this();
+    resolver.resolve(name, [this, self, name, port] (ip_addr_t const *addr) {
+        if (client_gone) {
+          // The client has given up in the meantime.
+          return;
+        }
+
+        if (not addr) {
+          LOG(ERROR) << "Couldn't resolve " << name;
+          lwip_abort();
+          return;
+        }
+
+        lwip_connect_to(*addr, port);
+      });
+  }
 
-    // This can only happen if we start asynchronous reads for sndbuf
-    // space we don't have.
-    assert(len <= tcp_sndbuf(tcp_pcb));
+  void lwip_connect_to(ip_addr_t ip_addr, uint16_t port)
+  {
+    if (client_gone) {
+      return;
+    }
 
-    if (len) {
-      // We pass the copy flag to avoid lwIP touch rcv_buffer, after we've destrpyed this instance.
-      err_t err = tcp_write(tcp_pcb, rcv_buffer.data(), len, TCP_WRITE_FLAG_COPY);
-      if (err != ERR_OK) {
-        LOG(ERROR) << "Couldn't send. tcp_write() returned: " << int(err);
-        return;
-      }
+    if (destination.empty()) {
+      destination = std::string(ipaddr_ntoa(&ip_addr)) + ":" + std::to_string(port);
     }
 
-    if (close_in_progress) {
-      LOG(INFO) << "Stop waiting for data from SOCKS client.";
+    if (not through_vpn(ip_addr.addr)) {
+      lwip_connect_direct(ip_addr, port);
       return;
     }
 
-    if (error == asio::error_code(asio::error::misc_errors::eof)) {
-      LOG(INFO) << "EOF. Closing connection.";
-      connection_close();
-      return;
-    } else if (error == asio::error_code(asio::error::operation_aborted)) {
-      LOG(ERROR) << "async_read aborted.";
-      return;
-    } else if (error) {
-      LOG(ERROR) << "Error while receiving data from SOCKS client: " << error.message();
-      // XXX When we get EOF, shutdown the TCP connection gracefully.
-      connection_hard_abort();
+    if (not ensure_tcp_pcb()) {
+      lwip_abort();
       return;
     }
 
-    // New async read with as many bytes as we can actually send.
-    size_t buflen = std::min<size_t>(rcv_buffer.size(), tcp_sndbuf(tcp_pcb));
-    LOG(INFO) << "Can send " << buflen << " bytes.";
+    LOG(INFO) << "Connecting to " << std::hex << ip_addr.addr << " port " << std::dec << port;
 
-    if (buflen) {
-      // Wait for more data.
-      auto self = shared_from_this();
-      async_read_in_progress = true;
-      asio::async_read(socket, asio::buffer(rcv_buffer.begin(), buflen),
-                       ASIO_CB_SHARED(self, data_received_cb));
+    err_t err = tcp_connect(tcp_pcb, &ip_addr, port, static_lwip_connected_cb);
+
+    if (err != ERR_OK) {
+      LOG(ERROR) << "tcp_connect failed with " << lwip_strerr(err) << " " << int(err);
+      lwip_abort();
     }
   }
 
-  void connect_success_written_cb(const asio::error_code &error, size_t)
+  /// The destination is outside the VPN. The client side connects to
+  /// it with a kernel socket and lwIP is not needed anymore.
+  void lwip_connect_direct(ip_addr_t ip_addr, uint16_t port)
   {
-    if (error) {
-      LOG(ERROR) << "Error while sending CONNECT response: " << error.message();
-      connection_hard_abort();
+    LOG(INFO) << "Connecting directly to " << ipaddr_ntoa(&ip_addr) << " port " << port;
+
+    direct = true;
+    lwip_release(false);
+
+    tcp::endpoint destination { asio::ip::address_v4(ntohl(ip_addr.addr)), port };
+
+    auto self = shared_from_this();
+    client_io.post([this, self, destination] { client_connect_direct(destination); });
+  }
+
+  void lwip_udp_associate(asio::ip::address client, asio::ip::address local)
+  {
+    if (client_gone) {
       return;
     }
 
-    // Wait for data.
-    asio::error_code ec;
-    data_received_cb(ec, 0);
-  }
+    destination = "UDP";
+    udp_relay = UdpRelay::create(lwip_io, resolver, client, local);
+    if (not udp_relay->start()) {
+      udp_relay.reset();
+      lwip_abort();
+      return;
+    }
 
+    auto relay = udp_relay->local_endpoint();
+    LOG(INFO) << "Relaying UDP on port " << relay.port();
+
+    auto self = shared_from_this();
+    client_io.post([this, self, relay] { client_udp_ready(relay); });
+  }
 
   err_t lwip_connected_cb(struct tcp_pcb *pcb, err_t err)
   {
@@ -219,40 +1472,95 @@ class SocksClient final : public std::enable_shared_from_this<SocksClient>
 
     if (err != ERR_OK) {
       LOG(ERROR) << "Connection failed: " << int(err);
-      connection_hard_abort();
+      lwip_abort();
       return ERR_ABRT;
     }
 
     LOG(INFO) << "Connected.";
-
-    static char connect_response[10] = { SOCKS_VERSION, 0 };
+    lwip_connected = true;
 
     auto self = shared_from_this();
-    asio::async_write(socket, asio::buffer(connect_response, sizeof(connect_response)),
-                      ASIO_CB_SHARED(self, connect_success_written_cb));
+    client_io.post([this, self] { client_connected(); });
 
-    return ERR_OK;
+    // Early data from an optimistic client. tcp_input sends it with
+    // the ACK of the SYN-ACK.
+    upstream_lwip_progress();
+
+    return lwip_aborted() ? ERR_ABRT : ERR_OK;
   }
 
   err_t lwip_tcp_sent_cb(struct tcp_pcb *pcb, uint16_t len)
   {
-    LOG(INFO) << "Remote ACK'd " << int(len) << " bytes.";
+    TRACE << "Remote ACK'd " << int(len) << " bytes.";
+
+    upstream_lwip_acked += len;
+    acked_total.store(upstream_lwip_acked, std::memory_order_release);
+
+    if (pcb_closing) {
+      // tcp_pcb is already gone, but lwIP still calls us with pcb.
+      if (upstream_lwip_acked == upstream_written) {
+        tcp_arg (pcb, nullptr);
+        tcp_err (pcb, nullptr);
+        tcp_sent(pcb, nullptr);
+
+        lwip_release(false);
+      }
+      return ERR_OK;
+    }
+
     assert(pcb == tcp_pcb);
 
-    // If there is an async_read in progress, we don't need to do
-    // anything here, because when it is done, it will program a new
-    // read. If there is no read in progress, we need to start a new
-    // one here.
-    //
-    // Also make sure this is called from our IO thread, otherwise
-    // this will race.
+    unblock_upstream();
+    upstream_lwip_progress();
 
-    if (not async_read_in_progress) {
-      LOG(INFO) << "Starting new async_read, because none was in progress.";
-      asio::error_code ec;
-      data_received_cb(ec, 0);
+    return lwip_aborted() ? ERR_ABRT : ERR_OK;
+  }
+
+  err_t lwip_tcp_recv_cb(struct tcp_pcb *pcb, pbuf *p, err_t err)
+  {
+    assert(pcb == tcp_pcb);
+
+    if (err != ERR_OK) {
+      LOG(ERROR) << "Receive callback with error: " << int(err);
+
+      // Anything but ERR_OK would make lwIP keep p as refused data,
+      // which we just freed.
+      if (p) {
+        pbuf_free(p);
+      }
+      return ERR_OK;
+    }
+
+    if (not p) {
+      remote_eof_seen = true;
+
+      // Otherwise push_downstream_backlog() passes it on.
+      if (downstream_backlog.empty()) {
+        post_remote_eof();
+      }
+
+      if (upstream_shut) {
+        LOG(INFO) << "EOF. Closing connection.";
+        lwip_close();
+      }
+
+      return lwip_aborted() ? ERR_ABRT : ERR_OK;
+    }
+
+    if (client_gone) {
+      tcp_recved(pcb, p->tot_len);
+      pbuf_free(p);
+      return ERR_OK;
+    }
+
+    // We keep lwIP's reference until the client side has written the
+    // data.
+    if (downstream_outstanding < DOWNSTREAM_QUEUE_SIZE and downstream_backlog.empty()) {
+      downstream_queue.push(p);
+      downstream_outstanding++;
+      wake_client();
     } else {
-      LOG(INFO) << "Not starting new async_read.";
+      downstream_backlog.push_back(p);
     }
 
     return ERR_OK;
@@ -268,9 +1576,10 @@ class SocksClient final : public std::enable_shared_from_this<SocksClient>
   {
     LOG(ERROR) << "Error callback from lwIP: '" << lwip_strerr(err) << "' " << int(err);
 
-    if (tcp_pcb) {
-      connection_hard_abort();
-    }
+    // lwIP has already freed the PCB and all segments that referenced
+    // our buffers.
+    tcp_pcb = nullptr;
+    lwip_release(true);
   }
 
   static void static_lwip_err_cb(void *arg, err_t err)
@@ -285,12 +1594,25 @@ class SocksClient final : public std::enable_shared_from_this<SocksClient>
     return wrap->ptr->lwip_tcp_sent_cb(pcb, len);
   }
 
+  static err_t static_lwip_tcp_recv_cb(void *arg, struct tcp_pcb *pcb, pbuf *p, err_t err)
+  {
+    auto *wrap = static_cast<PointerWrap *>(arg);
+    return wrap->ptr->lwip_tcp_recv_cb(pcb, p, err);
+  }
+
   /// Allocate a lwIP PCB and configure it with handler functions.
   bool ensure_tcp_pcb()
   {
     // Allocate new PCB from lwIP;
     if ((tcp_pcb = tcp_new()) == nullptr) {
       LOG(ERROR) << "lwIP out of memory. Couldn't allocate TCP PCB.";
+      metrics().tcp_new_failures++;
+      return false;
+    }
+
+    if (not shard_bind_local_port(tcp_pcb)) {
+      tcp_close(tcp_pcb);
+      tcp_pcb = nullptr;
       return false;
     }
 
@@ -301,234 +1623,220 @@ class SocksClient final : public std::enable_shared_from_this<SocksClient>
     tcp_arg (tcp_pcb, tcp_pcb_arg);
     tcp_err (tcp_pcb, static_lwip_err_cb);
     tcp_sent(tcp_pcb, static_lwip_tcp_sent_cb);
+    tcp_recv(tcp_pcb, static_lwip_tcp_recv_cb);
 
     return true;
   }
 
-  void handle_connect_by_ipv4()
-  {
-    ensure_tcp_pcb();
-
-    ip_addr_t ip_addr;
-
-    memcpy(&ip_addr, rcv_buffer.data() + ADDRESS_START_OFFSET, sizeof(ip_addr.addr));
-
-    uint16_t port = rcv_buffer.at(ADDRESS_START_OFFSET + 4) << 8 | rcv_buffer.at(ADDRESS_START_OFFSET + 5);
-
-    LOG(INFO) << "Connecting to " << std::hex << ip_addr.addr << " port " << port;
+public:
 
-    err_t err = tcp_connect(tcp_pcb, &ip_addr, port, static_lwip_connected_cb);
+  tcp::socket &get_socket() { return socket; }
 
-    if (err != ERR_OK) {
-      LOG(ERROR) << "tcp_connect failed with " << lwip_strerr(err) << " " << int(err);
-      connection_hard_abort();
-    }
+  /// Client buffers of the calling thread. Pools are not thread-safe,
+  /// so each I/O thread has its own. Buffers can outlive their
+  /// connection, so pools are never destroyed.
+  static BufferPool &buffer_pool()
+  {
+    static thread_local BufferPool *pool = new BufferPool { 16 << 10, 256 };
+    return *pool;
   }
 
-  void handle_connect()
+  /// Call on the lwIP thread.
+  static size_t connections() { return live.size(); }
+
+  /// One line about this connection and its lwIP PCB. This is cheap
+  /// enough to do for all connections every second. Call on the lwIP
+  /// thread.
+  void describe(std::ostream &out) const
   {
-    ADDRESS_TYPE at = ADDRESS_TYPE(rcv_buffer.at(3));
+    out << peer << " -> " << (destination.empty() ? "-" : destination);
 
-    switch (at) {
-    case ADDRESS_TYPE::DOMAINNAME:
-      handle_connect_by_name();
-      break;
-    case ADDRESS_TYPE::IPV4:
-      handle_connect_by_ipv4();
-      break;
-    default:
-      LOG(ERROR) << "Address type " << at << " not supported.";
-      break;
+    if (tcp_pcb) {
+      // sa and sv are 8 times the smoothed RTT and 4 times its
+      // variance in ticks of the slow timer.
+      out << " state=" << tcp_state_str[tcp_pcb->state]
+          << " cwnd=" << tcp_pcb->cwnd
+          << " ssthresh=" << tcp_pcb->ssthresh
+          << " srtt_ms=" << (tcp_pcb->sa >> 3) * TCP_SLOW_INTERVAL
+          << " rttvar_ms=" << (tcp_pcb->sv >> 2) * TCP_SLOW_INTERVAL
+          << " snd_queuelen=" << tcp_pcb->snd_queuelen
+          << " snd_buf=" << tcp_pcb->snd_buf
+          << " unacked=" << uint32_t(tcp_pcb->snd_nxt - tcp_pcb->lastack)
+          << " rcv_wnd=" << tcp_pcb->rcv_wnd;
+    } else {
+      out << " state=" << (pcb_closing          ? "CLOSING" :
+                           direct               ? "DIRECT" :
+                           destination.empty()  ? "HANDSHAKE" : "NO_PCB");
     }
+
+    out << " up_unacked=" << (upstream_written - upstream_lwip_acked)
+        << " down_outstanding=" << downstream_outstanding
+        << " down_backlog=" << downstream_backlog.size()
+        << " bytes_up=" << bytes_upstream.get()
+        << " bytes_down=" << bytes_downstream.get()
+        << (upstream_eof ? " client_eof" : "")
+        << (remote_eof_seen ? " remote_eof" : "")
+        << "\n";
   }
 
-  void command_received_cb(const asio::error_code &error, size_t len)
+  void lwip_accepted()
   {
-    if (error) {
-      LOG(ERROR) << "Error while receiving command header: " << error;
-      return;
-    }
-
-    auto self = shared_from_this();
-
-    COMMAND      cmd = COMMAND(rcv_buffer.at(1));
-    ADDRESS_TYPE at  = ADDRESS_TYPE(rcv_buffer.at(3));
-
-    LOG(INFO) << "Command '" << command_string(cmd) << "' Address '" << address_type_string(at) << "'";
-
-    switch (cmd) {
-    case COMMAND::CONNECT:
-      handle_connect();
-      break;
+    asio::error_code ec;
+    auto endpoint = socket.remote_endpoint(ec);
 
-    default:
-      LOG(ERROR) << "Can't handle command.";
-      break;
-    }
+    peer = endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+    live.insert(this);
   }
 
-  void read_command_first_cb(const asio::error_code &error, size_t len)
+  static void describe_all(std::ostream &out)
   {
-    if (error) {
-      LOG(ERROR) << "Error while receiving command header: " << error;
-      return;
-    }
-
-    CHECK_EQ(len, INITIAL_COMMAND_BYTES);
-
-    auto self = shared_from_this();
-    uint8_t version = rcv_buffer.at(0);
-
-    if (version != SOCKS_VERSION) {
-      LOG(ERROR) << "Client specified wrong SOCKS version: " << int(version);
-      return;
+    for (SocksClient const *client : live) {
+      client->describe(out);
     }
+  }
 
-    // Read address type first to figure out how long this packet is.
-    size_t plen = 2;
-    ADDRESS_TYPE at = ADDRESS_TYPE(rcv_buffer.at(3));
-
-    switch (at) {
-    case IPV4:       plen += 3;                    break;
-    case DOMAINNAME: plen += rcv_buffer.at(4);     break;
-    case IPV6:       plen += 15;                   break;
-    default:
-      // Not supported. Proper reply will be sent in command_received_cb.
-      break;
-    };
-
-    CHECK(INITIAL_COMMAND_BYTES + plen < rcv_buffer.size());
+  SocksClient(asio::io_service &lwip_io, asio::io_service &client_io, Resolver &resolver)
+    : lwip_io(lwip_io), client_io(client_io), socket(client_io), resolver(resolver)
+  { }
 
-    // Wait for rest of command packet.
-    asio::async_read(socket, asio::buffer(rcv_buffer.begin() + INITIAL_COMMAND_BYTES, plen),
-                     ASIO_CB_SHARED(self, command_received_cb));
+  static self_t create(asio::io_service &lwip_io, asio::io_service &client_io, Resolver &resolver)
+  {
+    return std::make_shared<SocksClient>(lwip_io, client_io, resolver);
   }
 
-  // Called when we have successfully replied to the client's auth
-  // packet.
-  void version_written_cb(const asio::error_code &error, size_t len)
+  /// Call on the lwIP thread after the socket is accepted. The
+  /// handshake continues on the client side.
+  void start()
   {
-    if (error) {
-      LOG(ERROR) << "Error while sending greeting: " << error;
-      return;
-    }
+    lwip_accepted();
 
     auto self = shared_from_this();
-
-    // Wait for command packet.
-    asio::async_read(socket, asio::buffer(rcv_buffer, INITIAL_COMMAND_BYTES),
-                     ASIO_CB_SHARED(self, read_command_first_cb));
+    client_io.post([this, self] { client_start(); });
   }
 
-  // The client has sent his list of authentication methods.
-  void methods_received_cb(const asio::error_code &error, size_t len)
+  /// Like start(), but for a connection from the transparent listener
+  /// that was going to destination. We connect right away.
+  void start_transparent(tcp::endpoint const &destination)
   {
-    if (error) {
-      LOG(ERROR) << "Error reading auth methods from client: " << error;
-      return;
-    }
+    lwip_accepted();
 
     auto self = shared_from_this();
+    client_io.post([this, self] { client_start_transparent(); });
 
-    CHECK_EQ(rcv_buffer.at(1), len);
-
-    for (size_t i = 0; i < len; i++) {
-      uint8_t method = rcv_buffer.at(2 + i);
-
-      LOG(INFO) << "Method: " << int(method);
-
-      if (method == NO_AUTHENTICATION) {
-        LOG(INFO) << "Selected no authentication.";
-        static uint8_t version_response[] { SOCKS_VERSION, NO_AUTHENTICATION };
-
-        asio::async_write(socket, asio::buffer(version_response, sizeof(version_response)),
-                          ASIO_CB_SHARED(self, version_written_cb));
-        return;
-      }
+    ip_addr_t addr;
+    ip4_addr_set_u32(&addr, htonl(destination.address().to_v4().to_ulong()));
 
-      LOG(ERROR) << "We don't understand any auth method. Closing connection.";
-    }
+    lwip_connect_to(addr, destination.port());
   }
 
-  void hello_received_cb(const asio::error_code &error, size_t len)
-  {
-    if (error) {
-      LOG(ERROR) << "Error reading hello from client: " << error;
-      return;
-    }
-
-    auto self = shared_from_this();
-
-    CHECK_EQ(len, 2);
+  ~SocksClient() {
+    // Both sides have cleaned up by now. The client side has returned
+    // all pbufs and the lwIP side has told the client side to drop its
+    // buffers. See client_finish() and lwip_release().
+    LOG(INFO) << "Connection terminated.";
+  }
+};
 
-    uint8_t client_version = rcv_buffer.at(0);
-    uint8_t methods        = rcv_buffer.at(1);
+std::unordered_set<SocksClient *> SocksClient::live;
 
-    LOG(INFO) << "Client wants version " << int(client_version) << " with "
-              << int(methods) << " authentication methods.";
+#ifdef MACGYVERNET_TRACE
+DEFINE_bool(trace, false, "Log every packet and read. SIGUSR1 toggles this at runtime.");
 
-    if (client_version != SOCKS_VERSION) {
-      LOG(ERROR) << "Invalid version from client. Disconnecting.";
-      return;
-    }
+std::atomic<bool> trace_enabled { false };
 
-    // Read method data.
-    CHECK(rcv_buffer.size() >= 2 + methods);
-    asio::async_read(socket, asio::buffer(rcv_buffer.begin() + 2, methods),
-                     ASIO_CB_SHARED(self, methods_received_cb));
-  }
+static void toggle_trace_on_signal(asio::signal_set &signals)
+{
+  signals.async_wait([&signals] (const asio::error_code &error, int) {
+      if (error) {
+        return;
+      }
 
-public:
+      bool enabled = not trace_enabled.load(std::memory_order_relaxed);
+      trace_enabled.store(enabled, std::memory_order_relaxed);
+      LOG(INFO) << "Tracing " << (enabled ? "enabled." : "disabled.");
 
-  tcp::socket &get_socket() { return socket; }
+      toggle_trace_on_signal(signals);
+    });
+}
+#endif
 
-  SocksClient(asio::io_service &io)
-    : io_service(io), socket(io)
-  { }
+/// Where a connection to the transparent listener was going. REDIRECT
+/// rewrites the destination and leaves the original one for
+/// SO_ORIGINAL_DST. TPROXY doesn't rewrite anything, so our local
+/// address is the original destination.
+static bool original_destination(tcp::socket &socket, tcp::endpoint &destination)
+{
+  asio::error_code ec;
+  tcp::endpoint    local = socket.local_endpoint(ec);
 
-  static self_t create(asio::io_service &io)
-  {
-    return std::make_shared<SocksClient>(io);
+  if (ec) {
+    return false;
   }
 
-  void start()
-  {
-    auto self = shared_from_this();
-
+  // A connection that went to the listener itself wasn't redirected.
+  // Connecting it would loop.
+  if (FLAGS_tproxy) {
+    destination = local;
+    return destination.port() != FLAGS_transparent_port;
+  } else {
+    sockaddr_in addr;
+    socklen_t   len = sizeof(addr);
 
-    // We expect a version and authentication method packet first. We
-    // receive this in two parts. First the two-byte header and the
-    // methods data.
-
-    asio::async_read(socket, asio::buffer(rcv_buffer, 2), ASIO_CB_SHARED(self, hello_received_cb));
-  }
+    if (getsockopt(socket.native_handle(), SOL_IP, SO_ORIGINAL_DST, &addr, &len) < 0) {
+      return false;
+    }
 
-  ~SocksClient() {
-    _connection_hard_abort();
-    LOG(INFO) << "Connection terminated.";
+    destination = tcp::endpoint(asio::ip::address_v4(ntohl(addr.sin_addr.s_addr)), ntohs(addr.sin_port));
+    return destination != local;
   }
-};
+}
 
 /// Handles accepting connections and creates a SocksClient instance
-/// for each connection.
+/// for each connection. A transparent server accepts connections that
+/// iptables redirected to it instead of speaking SOCKS.
 class SocksServer : public std::enable_shared_from_this<SocksServer>
 {
   asio::io_service &io_service;
+  Resolver &resolver;
   tcp::acceptor acceptor;
+  bool const transparent;
 
 public:
 
-  SocksServer(asio::io_service &io_service, int port)
-    : io_service(io_service), acceptor(io_service, tcp::endpoint(tcp::v4(), port))
+  using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+  using ip_transparent = asio::detail::socket_option::boolean<SOL_IP, IP_TRANSPARENT>;
+
+  SocksServer(asio::io_service &io_service, Resolver &resolver, int port, bool transparent)
+    : io_service(io_service), resolver(resolver), acceptor(io_service), transparent(transparent)
 
   {
+    tcp::endpoint endpoint { tcp::v4(), uint16_t(port) };
+
+    acceptor.open(endpoint.protocol());
     acceptor.set_option(tcp::acceptor::reuse_address(true));
+
+    // TPROXY only delivers connections for foreign addresses to
+    // sockets that ask for them.
+    if (transparent and FLAGS_tproxy) {
+      acceptor.set_option(ip_transparent(true));
+    }
+
+    // All shards accept from the same port and the kernel balances
+    // connections between them.
+    if (shard_count() > 1) {
+      acceptor.set_option(reuse_port(true));
+    }
+
+    acceptor.bind(endpoint);
+    acceptor.listen();
+
     start_accept();
   }
 
   void start_accept()
   {
-    auto conn = SocksClient::create(acceptor.get_executor().context());
+    // The socket lives on one of the I/O threads.
+    auto conn = SocksClient::create(io_service, next_client_io_service(), resolver);
 
     acceptor.async_accept(conn->get_socket(),
                           [this, conn] (const asio::error_code &error) {
@@ -539,38 +1847,77 @@ public:
   void handle_accept(std::shared_ptr<SocksClient> conn,
                      const asio::error_code& error)
   {
-    if (not error) {
-      LOG(INFO) << "Accepted connection.";
+    tcp::endpoint destination;
+
+    if (error) {
+      LOG(ERROR) << "Accepting connection failed.";
+    } else if (not transparent) {
+      LOG(INFO) << "Accepted connection. " << SocksClient::connections() << " connections.";
       conn->start();
+    } else if (original_destination(conn->get_socket(), destination)) {
+      LOG(INFO) << "Accepted connection to " << destination << ". " << SocksClient::connections() << " connections.";
+      conn->start_transparent(destination);
     } else {
-      LOG(ERROR) << "Accepting connection failed.";
+      // Dropping conn closes the socket.
+      LOG(ERROR) << "Connection to the transparent port wasn't redirected. Closing it.";
     }
 
     start_accept();
   }
 
-  static std::shared_ptr<SocksServer> create(asio::io_service &io, int port)
+  static std::shared_ptr<SocksServer> create(asio::io_service &io, Resolver &resolver, int port,
+                                             bool transparent = false)
   {
-    return std::make_shared<SocksServer>(io, port);
+    return std::make_shared<SocksServer>(io, resolver, port, transparent);
   }
 
 };
 
 int main(int argc, char **argv)
 {
+  google::ParseCommandLineFlags(&argc, &argv, true);
   google::InitGoogleLogging(argv[0]);
 
+#ifdef MACGYVERNET_TRACE
+  trace_enabled = FLAGS_trace;
+#endif
+
   // Log to stderr for now.
   FLAGS_logtostderr = 1;
   LOG(INFO) << "When your corporate VPN policy sucks, you turn to...\n" << logo << "\n";
 
   try {
+    // This forks, if we run more than one lwIP stack.
+    unsigned shard = start_shards(prepare_backend);
+
     static asio::io_service io;
 
     // This initializes lwIP.
     initialize_backend(io);
 
-    auto server = SocksServer::create(io, 8080);
+    Resolver resolver { io, vpn_dns_servers() };
+    load_vpn_routes();
+
+    // lwIP stays on this thread.
+    start_io_threads(io);
+
+    auto server = SocksServer::create(io, resolver, 8080);
+
+    std::shared_ptr<SocksServer> transparent_server;
+    if (FLAGS_transparent_port) {
+      transparent_server = SocksServer::create(io, resolver, FLAGS_transparent_port, true);
+      LOG(INFO) << "Accepting redirected connections on port " << FLAGS_transparent_port << ".";
+    }
+
+    register_gauge("macgyvernet_socks_connections_active", "Open SOCKS connections.",
+                   [] { return SocksClient::connections(); });
+    register_page("/connections", SocksClient::describe_all);
+    start_metrics_server(io, shard);
+
+#ifdef MACGYVERNET_TRACE
+    asio::signal_set trace_signal { io, SIGUSR1 };
+    toggle_trace_on_signal(trace_signal);
+#endif
 
     io.run();
   } catch (std::system_error &e) {
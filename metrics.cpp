@@ -0,0 +1,335 @@
+#include <unistd.h>
+
+#include <asio.hpp>
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <lwip/stats.h>
+#include <lwip/memp.h>
+
+#include "metrics.hpp"
+#include "shard.hpp"
+
+DEFINE_string(metrics_socket, "", "Unix socket to serve Prometheus metrics on. Disabled if empty.");
+
+constexpr std::array<unsigned, 11> Metrics::HANDSHAKE_BUCKETS_MS;
+
+// Every thread's Metrics instance. Instances are never freed, so
+// counts of exited threads don't vanish. The mutex is only taken when
+// a thread registers and when metrics are scraped.
+static std::mutex               all_metrics_lock;
+static std::vector<Metrics *>   all_metrics;
+
+struct Gauge {
+  char const *name;
+  char const *help;
+  std::function<double ()> read;
+};
+
+static std::vector<Gauge> gauges;
+
+struct Page {
+  char const *path;
+  std::function<void (std::ostream &)> write;
+};
+
+static std::vector<Page> pages;
+
+static Metrics *register_thread()
+{
+  auto *m = new Metrics;
+
+  std::lock_guard<std::mutex> guard(all_metrics_lock);
+  all_metrics.push_back(m);
+
+  return m;
+}
+
+Metrics &metrics()
+{
+  static thread_local Metrics *m = register_thread();
+  return *m;
+}
+
+void Metrics::handshake_done(std::chrono::steady_clock::duration duration)
+{
+  auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+  size_t bucket = 0;
+
+  while (bucket < HANDSHAKE_BUCKETS_MS.size() and us > HANDSHAKE_BUCKETS_MS[bucket] * 1000) {
+    bucket++;
+  }
+
+  handshake_buckets[bucket]++;
+  handshake_us.add(us);
+}
+
+void register_gauge(char const *name, char const *help, std::function<double ()> read)
+{
+  gauges.push_back({ name, help, std::move(read) });
+}
+
+void register_page(char const *path, std::function<void (std::ostream &)> write)
+{
+  pages.push_back({ path, std::move(write) });
+}
+
+static uint64_t sum(Counter Metrics::*counter)
+{
+  std::lock_guard<std::mutex> guard(all_metrics_lock);
+  uint64_t total = 0;
+
+  for (Metrics *m : all_metrics) {
+    total += (m->*counter).get();
+  }
+
+  return total;
+}
+
+static void header(std::ostream &out, char const *name, char const *help, char const *type)
+{
+  out << "# HELP " << name << " " << help << "\n"
+      << "# TYPE " << name << " " << type << "\n";
+}
+
+static void counter(std::ostream &out, char const *name, char const *help,
+                    Counter Metrics::*counter)
+{
+  header(out, name, help, "counter");
+  out << name << " " << sum(counter) << "\n";
+}
+
+static void handshake_histogram(std::ostream &out)
+{
+  static char const name[] = "macgyvernet_socks_handshake_seconds";
+
+  std::array<uint64_t, Metrics::HANDSHAKE_BUCKETS_MS.size() + 1> buckets {};
+  uint64_t us = 0;
+
+  {
+    std::lock_guard<std::mutex> guard(all_metrics_lock);
+    for (Metrics *m : all_metrics) {
+      for (size_t i = 0; i < buckets.size(); i++) {
+        buckets[i] += m->handshake_buckets[i].get();
+      }
+      us += m->handshake_us.get();
+    }
+  }
+
+  header(out, name, "Time from accepting a SOCKS connection until the reply to its request.", "histogram");
+
+  // Prometheus buckets are cumulative.
+  uint64_t total = 0;
+  for (size_t i = 0; i < Metrics::HANDSHAKE_BUCKETS_MS.size(); i++) {
+    total += buckets[i];
+    out << name << "_bucket{le=\"" << Metrics::HANDSHAKE_BUCKETS_MS[i] / 1000.0 << "\"} "
+        << total << "\n";
+  }
+  total += buckets.back();
+
+  out << name << "_bucket{le=\"+Inf\"} " << total << "\n"
+      << name << "_sum " << us / 1e6 << "\n"
+      << name << "_count " << total << "\n";
+}
+
+static void lwip_memory(std::ostream &out)
+{
+  // With profile=server, the heap is malloc() and lwIP doesn't count
+  // it. macgyvernet_lwip_budget_used_bytes covers it instead.
+#if LWIP_STATS and MEM_STATS and not MEM_LIBC_MALLOC
+  header(out, "macgyvernet_lwip_mem_used_bytes", "Bytes allocated from the lwIP heap.", "gauge");
+  out << "macgyvernet_lwip_mem_used_bytes " << lwip_stats.mem.used << "\n";
+  header(out, "macgyvernet_lwip_mem_max_bytes", "Most bytes ever allocated from the lwIP heap.", "gauge");
+  out << "macgyvernet_lwip_mem_max_bytes " << lwip_stats.mem.max << "\n";
+  header(out, "macgyvernet_lwip_mem_errors_total", "Failed lwIP heap allocations.", "counter");
+  out << "macgyvernet_lwip_mem_errors_total " << lwip_stats.mem.err << "\n";
+#endif
+
+#if LWIP_STATS and MEMP_STATS
+  header(out, "macgyvernet_lwip_memp_used", "Elements in use per lwIP pool.", "gauge");
+  for (size_t i = 0; i < MEMP_MAX; i++) {
+    out << "macgyvernet_lwip_memp_used{pool=\"" << lwip_stats.memp[i]->name << "\"} "
+        << lwip_stats.memp[i]->used << "\n";
+  }
+
+  header(out, "macgyvernet_lwip_memp_max", "Most elements ever in use per lwIP pool.", "gauge");
+  for (size_t i = 0; i < MEMP_MAX; i++) {
+    out << "macgyvernet_lwip_memp_max{pool=\"" << lwip_stats.memp[i]->name << "\"} "
+        << lwip_stats.memp[i]->max << "\n";
+  }
+
+  header(out, "macgyvernet_lwip_memp_errors_total", "Failed allocations per lwIP pool.", "counter");
+  for (size_t i = 0; i < MEMP_MAX; i++) {
+    out << "macgyvernet_lwip_memp_errors_total{pool=\"" << lwip_stats.memp[i]->name << "\"} "
+        << lwip_stats.memp[i]->err << "\n";
+  }
+#endif
+}
+
+static void render_metrics(std::ostream &out)
+{
+  counter(out, "macgyvernet_tun_rx_packets_total", "Packets read from the TUN device.", &Metrics::tun_rx_packets);
+  counter(out, "macgyvernet_tun_rx_bytes_total",   "Bytes read from the TUN device.",   &Metrics::tun_rx_bytes);
+  counter(out, "macgyvernet_tun_rx_dropped_total", "Packets dropped before lwIP saw them.", &Metrics::tun_rx_dropped);
+  counter(out, "macgyvernet_tun_tx_packets_total", "Packets written to the TUN device.", &Metrics::tun_tx_packets);
+  counter(out, "macgyvernet_tun_tx_bytes_total",   "Bytes written to the TUN device.",   &Metrics::tun_tx_bytes);
+  counter(out, "macgyvernet_tun_tx_dropped_total", "Packets from lwIP that were never written.", &Metrics::tun_tx_dropped);
+  counter(out, "macgyvernet_tun_rx_gso_packets_total", "TCP super-packets read from the TUN device.", &Metrics::tun_rx_gso_packets);
+  counter(out, "macgyvernet_tun_tx_tso_frames_total", "TSO frames of several lwIP segments written to the TUN device.", &Metrics::tun_tx_tso_frames);
+
+  counter(out, "macgyvernet_pbuf_alloc_failures_total", "Failed pbuf allocations.", &Metrics::pbuf_alloc_failures);
+  counter(out, "macgyvernet_tcp_new_failures_total",    "Failed TCP PCB allocations.", &Metrics::tcp_new_failures);
+
+  counter(out, "macgyvernet_socks_connections_total", "Accepted SOCKS connections.", &Metrics::socks_connections);
+  counter(out, "macgyvernet_direct_connections_total", "SOCKS connections to destinations outside the VPN, relayed by the kernel.", &Metrics::direct_connections);
+  counter(out, "macgyvernet_transparent_connections_total", "Redirected connections accepted without a SOCKS handshake.", &Metrics::transparent_connections);
+  handshake_histogram(out);
+
+  // Every I/O thread has its own pool.
+  header(out, "macgyvernet_buffers_in_use", "Client data buffers leased from the pools.", "gauge");
+  out << "macgyvernet_buffers_in_use "
+      << sum(&Metrics::buffers_taken) - sum(&Metrics::buffers_returned) << "\n";
+
+  for (Gauge const &gauge : gauges) {
+    header(out, gauge.name, gauge.help, "gauge");
+    out << gauge.name << " " << gauge.read() << "\n";
+  }
+
+  lwip_memory(out);
+}
+
+/// Render the page for a request line like "GET /metrics HTTP/1.0".
+/// Returns false, if there is no such page.
+static bool render(std::string const &request_line, std::ostream &out)
+{
+  std::istringstream in(request_line);
+  std::string method, path;
+  in >> method >> path;
+
+  if (path == "/" or path == "/metrics") {
+    render_metrics(out);
+    return true;
+  }
+
+  for (Page const &page : pages) {
+    if (path == page.path) {
+      page.write(out);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+using asio::local::stream_protocol;
+
+/// A single request. We only look at the path in its first line and
+/// expect it to arrive in one piece.
+class MetricsSession final : public std::enable_shared_from_this<MetricsSession> {
+  stream_protocol::socket socket;
+
+  std::array<char, 1024> request;
+  std::string            response;
+
+  void request_received_cb(const asio::error_code &error, size_t len)
+  {
+    if (error) {
+      return;
+    }
+
+    std::string request_line(request.data(), len);
+    request_line.resize(std::min(request_line.find('\r'), request_line.find('\n')));
+
+    std::ostringstream out;
+    bool found = render(request_line, out);
+    std::string body = out.str();
+
+    response = std::string(found ? "HTTP/1.0 200 OK\r\n" : "HTTP/1.0 404 Not Found\r\n") +
+      "Content-Type: text/plain; version=0.0.4\r\n"
+      "Content-Length: " + std::to_string(body.size()) + "\r\n"
+      "\r\n" + body;
+
+    auto self = shared_from_this();
+    asio::async_write(socket, asio::buffer(response),
+                      [self] (const asio::error_code &, size_t) {
+                        asio::error_code ignored;
+                        self->socket.shutdown(stream_protocol::socket::shutdown_send, ignored);
+                      });
+  }
+
+public:
+
+  MetricsSession(asio::io_service &io) : socket(io) {}
+
+  stream_protocol::socket &get_socket() { return socket; }
+
+  void start()
+  {
+    auto self = shared_from_this();
+    socket.async_read_some(asio::buffer(request),
+                           [self] (const asio::error_code &error, size_t len) {
+                             self->request_received_cb(error, len);
+                           });
+  }
+};
+
+class MetricsServer {
+  asio::io_service         &io_service;
+  stream_protocol::acceptor acceptor;
+
+  void start_accept()
+  {
+    auto session = std::make_shared<MetricsSession>(io_service);
+
+    acceptor.async_accept(session->get_socket(),
+                          [this, session] (const asio::error_code &error) {
+                            if (not error) {
+                              session->start();
+                            } else {
+                              LOG(ERROR) << "Accepting metrics connection failed: " << error.message();
+                            }
+
+                            start_accept();
+                          });
+  }
+
+public:
+
+  MetricsServer(asio::io_service &io, std::string const &path)
+    : io_service(io), acceptor(io)
+  {
+    // A previous instance may have left its socket behind.
+    unlink(path.c_str());
+
+    acceptor.open();
+    acceptor.bind(stream_protocol::endpoint(path));
+    acceptor.listen();
+
+    LOG(INFO) << "Serving metrics on " << path << ".";
+
+    start_accept();
+  }
+};
+
+void start_metrics_server(asio::io_service &io, unsigned shard)
+{
+  if (FLAGS_metrics_socket.empty()) {
+    return;
+  }
+
+  std::string path = FLAGS_metrics_socket;
+  if (shard_count() > 1) {
+    path += "." + std::to_string(shard);
+  }
+
+  // Lives as long as the process.
+  new MetricsServer(io, path);
+}
+
+// EOF
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <asio/io_service.hpp>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+
+/// A counter that only its owning thread increments. An increment is
+/// a plain load and store without a locked instruction. Readers on
+/// other threads see a consistent, but possibly slightly stale value.
+class Counter {
+  std::atomic<uint64_t> value { 0 };
+
+public:
+
+  void add(uint64_t n = 1)
+  {
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  Counter &operator++() { add(); return *this; }
+  void     operator++(int) { add(); }
+
+  uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+/// Counters of a single thread. Every thread gets its own instance
+/// via metrics() and the exporter sums them up.
+struct Metrics {
+  Counter tun_rx_packets;
+  Counter tun_rx_bytes;
+  Counter tun_rx_dropped;
+  Counter tun_tx_packets;
+  Counter tun_tx_bytes;
+  Counter tun_tx_dropped;
+
+  // Only with --tun_offload.
+  Counter tun_rx_gso_packets;
+  Counter tun_tx_tso_frames;
+
+  Counter pbuf_alloc_failures;
+  Counter tcp_new_failures;
+
+  Counter socks_connections;
+  Counter direct_connections;
+  Counter transparent_connections;
+
+  // Buffers taken from and returned to the calling thread's
+  // BufferPool.
+  Counter buffers_taken;
+  Counter buffers_returned;
+
+  // Upper bounds of the handshake duration buckets in milliseconds.
+  // The last bucket catches everything else.
+  static constexpr std::array<unsigned, 11> HANDSHAKE_BUCKETS_MS {
+    { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 5000 } };
+
+  std::array<Counter, HANDSHAKE_BUCKETS_MS.size() + 1> handshake_buckets;
+  Counter handshake_us;
+
+  /// Record the time from accepting a SOCKS connection until the
+  /// reply to its request was sent.
+  void handshake_done(std::chrono::steady_clock::duration duration);
+};
+
+/// The calling thread's counters.
+Metrics &metrics();
+
+/// Export a value that is computed when metrics are scraped, such as
+/// the current number of connections. read() is called on the thread
+/// that runs the metrics server's io_service.
+void register_gauge(char const *name, char const *help, std::function<double ()> read);
+
+/// Serve write()'s output on the metrics socket when path is
+/// requested instead of /metrics. For admin commands, such as listing
+/// connections.
+void register_page(char const *path, std::function<void (std::ostream &)> write);
+
+/// Serve metrics in Prometheus text format on the Unix socket given
+/// by --metrics_socket. Does nothing, if the flag is empty. With
+/// several shards, each shard appends its index to the path.
+void start_metrics_server(asio::io_service &io, unsigned shard);
+
+// EOF
@@ -0,0 +1,366 @@
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstring>
+
+#include <glog/logging.h>
+
+#include "resolver.hpp"
+#include "metrics.hpp"
+#include "shard.hpp"
+
+namespace {
+
+  enum : uint16_t {
+    FLAG_RESPONSE          = 0x8000,
+    FLAG_RECURSION_DESIRED = 0x0100,
+    RCODE_MASK             = 0x000F,
+
+    RCODE_NOERROR  = 0,
+    RCODE_NXDOMAIN = 3,
+
+    TYPE_A   = 1,
+    TYPE_SOA = 6,
+    CLASS_IN = 1,
+
+    HEADER_BYTES = 12,
+  };
+
+  uint16_t get16(uint8_t const *p) { return p[0] << 8 | p[1]; }
+  uint32_t get32(uint8_t const *p) { return uint32_t(get16(p)) << 16 | get16(p + 2); }
+
+  void put16(uint8_t *p, uint16_t v) { p[0] = v >> 8; p[1] = v; }
+
+  /// Advance pos over a (possibly compressed) domain name. Returns
+  /// false, if the message is truncated.
+  bool skip_name(uint8_t const *msg, size_t len, size_t &pos)
+  {
+    while (pos < len) {
+      uint8_t l = msg[pos];
+
+      if ((l & 0xC0) == 0xC0) {
+        pos += 2;
+        return pos <= len;
+      } else if (l == 0) {
+        pos += 1;
+        return true;
+      }
+
+      pos += 1 + l;
+    }
+
+    return false;
+  }
+
+  /// Encode a query for the A record of name. Returns the length of
+  /// the message or 0, if name is not a valid domain name.
+  size_t encode_query(uint8_t *msg, size_t len, uint16_t id, std::string const &name)
+  {
+    memset(msg, 0, HEADER_BYTES);
+    put16(msg + 0, id);
+    put16(msg + 2, FLAG_RECURSION_DESIRED);
+    put16(msg + 4, 1);
+
+    size_t pos = HEADER_BYTES;
+    size_t label_start = 0;
+
+    while (label_start < name.size()) {
+      size_t dot = std::min(name.find('.', label_start), name.size());
+      size_t label_len = dot - label_start;
+
+      if (label_len == 0 or label_len > 63 or pos + 1 + label_len + 5 > len) {
+        return 0;
+      }
+
+      msg[pos++] = label_len;
+      memcpy(msg + pos, name.data() + label_start, label_len);
+      pos += label_len;
+
+      label_start = dot + 1;
+    }
+
+    msg[pos++] = 0;
+    put16(msg + pos, TYPE_A);    pos += 2;
+    put16(msg + pos, CLASS_IN);  pos += 2;
+
+    return pos;
+  }
+
+}
+
+Resolver::Resolver(asio::io_service &io, std::vector<std::string> const &server_names)
+  : io_service(io), random(std::random_device()())
+{
+  for (auto const &name : server_names) {
+    ip_addr_t addr;
+
+    if (ipaddr_aton(name.c_str(), &addr)) {
+      servers.push_back(addr);
+      LOG(INFO) << "Using DNS server " << name << ".";
+    } else {
+      LOG(ERROR) << "Ignoring invalid DNS server '" << name << "'.";
+    }
+  }
+
+  if (servers.empty()) {
+    LOG(WARNING) << "No DNS servers configured. Connecting by name will fail.";
+  }
+
+  udp_pcb = udp_new();
+  CHECK(udp_pcb) << "Couldn't allocate UDP PCB for DNS.";
+
+  CHECK(shard_bind_local_port(udp_pcb));
+  udp_recv(udp_pcb, static_udp_recv_cb, this);
+}
+
+Resolver::~Resolver()
+{
+  udp_remove(udp_pcb);
+}
+
+void Resolver::resolve(std::string const &host, callback_t callback)
+{
+  std::string name = host;
+  std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+  if (not name.empty() and name.back() == '.') {
+    name.pop_back();
+  }
+
+  // Literal addresses need no query.
+  ip_addr_t literal;
+  if (ipaddr_aton(name.c_str(), &literal)) {
+    callback(&literal);
+    return;
+  }
+
+  auto cached = cache.find(name);
+  if (cached != cache.end()) {
+    if (cached->second.expires > clock::now()) {
+      callback(cached->second.negative ? nullptr : &cached->second.addr);
+      return;
+    }
+
+    cache.erase(cached);
+  }
+
+  auto running = pending.find(name);
+  if (running != pending.end()) {
+    running->second->waiters.push_back(std::move(callback));
+    return;
+  }
+
+  if (servers.empty()) {
+    callback(nullptr);
+    return;
+  }
+
+  std::unique_ptr<Query> query { new Query { io_service, name } };
+  query->waiters.push_back(std::move(callback));
+
+  Query &q = *query;
+  pending.emplace(name, std::move(query));
+  send_query(q);
+}
+
+void Resolver::send_query(Query &query)
+{
+  unsigned server = query.tries % servers.size();
+
+  if (query.tries++ == servers.size() * TRIES_PER_SERVER) {
+    LOG(ERROR) << "No answer for '" << query.name << "'.";
+    finish(query.name, nullptr);
+    return;
+  }
+
+  // Every retry gets a fresh ID, so late answers are ignored.
+  auto old = pending_by_id.find(query.id);
+  if (old != pending_by_id.end() and old->second == &query) {
+    pending_by_id.erase(old);
+  }
+
+  do {
+    query.id = random();
+  } while (pending_by_id.count(query.id));
+  pending_by_id[query.id] = &query;
+
+  pbuf *p = pbuf_alloc(PBUF_TRANSPORT, MAX_MESSAGE_BYTES, PBUF_RAM);
+  if (not p) {
+    LOG(ERROR) << "Out of memory while querying '" << query.name << "'.";
+    metrics().pbuf_alloc_failures++;
+    finish(query.name, nullptr);
+    return;
+  }
+
+  size_t len = encode_query(static_cast<uint8_t *>(p->payload), p->len, query.id, query.name);
+  if (len == 0) {
+    LOG(ERROR) << "Can't resolve invalid name '" << query.name << "'.";
+    pbuf_free(p);
+    finish(query.name, nullptr);
+    return;
+  }
+
+  pbuf_realloc(p, len);
+  err_t err = udp_sendto(udp_pcb, p, &servers[server], DNS_PORT);
+  pbuf_free(p);
+
+  if (err != ERR_OK) {
+    LOG(ERROR) << "udp_sendto failed with " << lwip_strerr(err) << " " << int(err);
+  }
+
+  std::string name = query.name;
+  uint16_t    id   = query.id;
+
+  query.timer.expires_from_now(std::chrono::milliseconds(QUERY_TIMEOUT_MS));
+  query.timer.async_wait([this, name, id] (const asio::error_code &error) {
+      if (not error) {
+        query_timeout(name, id);
+      }
+    });
+}
+
+void Resolver::query_timeout(std::string const &name, uint16_t id)
+{
+  auto it = pending_by_id.find(id);
+
+  // The answer might have raced with the timer.
+  if (it != pending_by_id.end() and it->second->name == name) {
+    send_query(*it->second);
+  }
+}
+
+void Resolver::finish(std::string const &name, ip_addr_t const *addr)
+{
+  auto it = pending.find(name);
+  CHECK(it != pending.end());
+
+  std::unique_ptr<Query> query = std::move(it->second);
+  pending.erase(it);
+  pending_by_id.erase(query->id);
+
+  asio::error_code ec;
+  query->timer.cancel(ec);
+
+  for (auto &waiter : query->waiters) {
+    waiter(addr);
+  }
+}
+
+void Resolver::insert_cache(std::string const &name, CacheEntry const &entry)
+{
+  if (cache.size() >= MAX_CACHE_ENTRIES) {
+    auto now = clock::now();
+
+    for (auto it = cache.begin(); it != cache.end(); ) {
+      it = it->second.expires <= now ? cache.erase(it) : std::next(it);
+    }
+
+    // Still full. Make room at the expense of an arbitrary entry.
+    if (cache.size() >= MAX_CACHE_ENTRIES) {
+      cache.erase(cache.begin());
+    }
+  }
+
+  cache[name] = entry;
+}
+
+void Resolver::udp_recv_cb(pbuf *p, ip_addr_t const *addr, u16_t port)
+{
+  std::array<uint8_t, MAX_MESSAGE_BYTES> msg;
+  size_t len = pbuf_copy_partial(p, msg.data(), msg.size(), 0);
+  pbuf_free(p);
+
+  if (port != DNS_PORT or
+      std::none_of(servers.begin(), servers.end(),
+                   [addr] (ip_addr_t const &s) { return s.addr == addr->addr; })) {
+    return;
+  }
+
+  if (len < HEADER_BYTES) {
+    return;
+  }
+
+  uint16_t id    = get16(&msg[0]);
+  uint16_t flags = get16(&msg[2]);
+
+  auto it = pending_by_id.find(id);
+  if (it == pending_by_id.end() or not (flags & FLAG_RESPONSE)) {
+    return;
+  }
+
+  Query &query = *it->second;
+  uint16_t rcode = flags & RCODE_MASK;
+
+  if (rcode != RCODE_NOERROR and rcode != RCODE_NXDOMAIN) {
+    LOG(WARNING) << "DNS server returned error " << rcode << " for '" << query.name << "'.";
+    send_query(query);
+    return;
+  }
+
+  uint16_t questions   = get16(&msg[4]);
+  uint16_t answers     = get16(&msg[6]);
+  uint16_t authorities = get16(&msg[8]);
+  size_t   pos         = HEADER_BYTES;
+
+  for (unsigned i = 0; i < questions; i++) {
+    if (not skip_name(msg.data(), len, pos) or (pos += 4) > len) {
+      return;
+    }
+  }
+
+  CacheEntry entry { true, {}, {} };
+  uint32_t   ttl = DEFAULT_NEGATIVE_TTL;
+
+  // Walk answer and authority records. We take the first A record
+  // and otherwise use the SOA record for the negative TTL (RFC 2308).
+  for (unsigned i = 0; i < unsigned(answers + authorities); i++) {
+    if (not skip_name(msg.data(), len, pos) or pos + 10 > len) {
+      return;
+    }
+
+    uint16_t type     = get16(&msg[pos]);
+    uint16_t rclass   = get16(&msg[pos + 2]);
+    uint32_t rr_ttl   = get32(&msg[pos + 4]);
+    uint16_t rdlength = get16(&msg[pos + 8]);
+    pos += 10;
+
+    if (pos + rdlength > len) {
+      return;
+    }
+
+    if (i < answers and type == TYPE_A and rclass == CLASS_IN and rdlength == 4) {
+      entry.negative = false;
+      memcpy(&entry.addr.addr, &msg[pos], 4);
+      ttl = rr_ttl;
+      break;
+    }
+
+    if (i >= answers and type == TYPE_SOA and rdlength >= 20) {
+      uint32_t minimum = get32(&msg[pos + rdlength - 4]);
+      ttl = std::min(rr_ttl, minimum);
+    }
+
+    pos += rdlength;
+  }
+
+  ttl = std::min<uint32_t>(ttl, MAX_TTL);
+  entry.expires = clock::now() + std::chrono::seconds(ttl);
+
+  if (ttl) {
+    insert_cache(query.name, entry);
+  }
+
+  if (entry.negative) {
+    LOG(INFO) << "'" << query.name << "' does not resolve.";
+  }
+
+  finish(query.name, entry.negative ? nullptr : &entry.addr);
+}
+
+void Resolver::static_udp_recv_cb(void *arg, struct udp_pcb *, pbuf *p,
+                                  ip_addr_t const *addr, u16_t port)
+{
+  static_cast<Resolver *>(arg)->udp_recv_cb(p, addr, port);
+}
+
+// EOF
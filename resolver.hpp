@@ -0,0 +1,106 @@
+#pragma once
+
+#include <asio/io_service.hpp>
+#include <asio/steady_timer.hpp>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <lwip/ip_addr.h>
+#include <lwip/pbuf.h>
+#include <lwip/udp.h>
+
+/// Resolves host names with the DNS servers behind the VPN. Queries
+/// are sent through lwIP. Answers, including negative ones, are
+/// cached for as long as their TTL allows and concurrent lookups of
+/// the same name share a single query.
+class Resolver {
+public:
+
+  /// Called with the address, or with nullptr, if the name could not
+  /// be resolved.
+  using callback_t = std::function<void (ip_addr_t const *addr)>;
+
+private:
+
+  using clock = std::chrono::steady_clock;
+
+  enum {
+    DNS_PORT = 53,
+
+    // Classic DNS over UDP never exceeds this.
+    MAX_MESSAGE_BYTES = 512,
+
+    // Each server is asked this often before we give up.
+    TRIES_PER_SERVER = 2,
+
+    QUERY_TIMEOUT_MS = 1000,
+
+    // Bounds for cached TTLs in seconds.
+    MAX_TTL               = 24 * 60 * 60,
+    DEFAULT_NEGATIVE_TTL  = 60,
+
+    MAX_CACHE_ENTRIES = 4096,
+  };
+
+  struct CacheEntry {
+    bool              negative;
+    ip_addr_t         addr;
+    clock::time_point expires;
+  };
+
+  struct Query {
+    std::string             name;
+    uint16_t                id = 0;
+    unsigned                tries = 0;
+    asio::steady_timer      timer;
+    std::vector<callback_t> waiters;
+
+    Query(asio::io_service &io, std::string const &name)
+      : name(name), timer(io)
+    { }
+  };
+
+  asio::io_service &io_service;
+
+  std::vector<ip_addr_t> servers;
+
+  struct udp_pcb *udp_pcb = nullptr;
+
+  std::unordered_map<std::string, CacheEntry>             cache;
+  std::unordered_map<std::string, std::unique_ptr<Query>> pending;
+  std::unordered_map<uint16_t, Query *>                   pending_by_id;
+
+  std::mt19937 random;
+
+  void send_query(Query &query);
+  void query_timeout(std::string const &name, uint16_t id);
+  void finish(std::string const &name, ip_addr_t const *addr);
+  void insert_cache(std::string const &name, CacheEntry const &entry);
+
+  void udp_recv_cb(pbuf *p, ip_addr_t const *addr, u16_t port);
+
+  static void static_udp_recv_cb(void *arg, struct udp_pcb *pcb, pbuf *p,
+                                 ip_addr_t const *addr, u16_t port);
+
+public:
+
+  /// Must be created after lwIP is initialized. Servers are given as
+  /// dotted quads.
+  Resolver(asio::io_service &io, std::vector<std::string> const &servers);
+  ~Resolver();
+
+  Resolver(Resolver const &) = delete;
+  Resolver &operator=(Resolver const &) = delete;
+
+  /// Resolve name to an IPv4 address. The callback may be called
+  /// before this function returns.
+  void resolve(std::string const &name, callback_t callback);
+};
+
+// EOF
@@ -0,0 +1,150 @@
+#include <arpa/inet.h>
+
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "routes.hpp"
+#include "vpn_env.hpp"
+
+DEFINE_bool(split_tunnel, true, "Connect directly to destinations outside the VPN's split tunnel routes instead of going through lwIP");
+DEFINE_string(split_routes_file, "", "Additional split tunnel routes. One network per line as a.b.c.d/len. A leading ! excludes it from the VPN");
+
+namespace {
+
+  struct Route {
+    uint32_t network;            // Host byte order.
+    uint32_t mask;
+    unsigned prefix_len;
+    bool     include;
+  };
+
+}
+
+// Longest prefix first, so the first match wins.
+static std::vector<Route> routes;
+static bool               have_includes = false;
+
+static void add_route(uint32_t network, unsigned prefix_len, bool include)
+{
+  uint32_t mask = prefix_len ? ~uint32_t(0) << (32 - prefix_len) : 0;
+
+  routes.push_back({ network & mask, mask, prefix_len, include });
+  have_includes |= include;
+}
+
+/// Parse "a.b.c.d/len".
+static bool parse_route(std::string const &text, bool include)
+{
+  size_t   slash = text.find('/');
+  in_addr  addr;
+  unsigned prefix_len = 32;
+
+  if (slash != std::string::npos) {
+    char const *start = text.c_str() + slash + 1;
+    char       *end;
+    prefix_len = strtoul(start, &end, 10);
+
+    // An empty length would be /0 and match everything.
+    if (not isdigit(static_cast<unsigned char>(*start)) or *end or prefix_len > 32) {
+      return false;
+    }
+  }
+
+  if (inet_pton(AF_INET, text.substr(0, slash).c_str(), &addr) != 1) {
+    return false;
+  }
+
+  add_route(ntohl(addr.s_addr), prefix_len, include);
+  return true;
+}
+
+/// openconnect sets PREFIX=<count> and PREFIX_<i>_ADDR and
+/// PREFIX_<i>_MASKLEN for each network.
+static void load_split_env(std::string const &prefix, bool include)
+{
+  const char *count = getenv(prefix.c_str());
+
+  for (int i = 0; count and i < atoi(count); i++) {
+    std::string item = prefix + "_" + std::to_string(i) + "_";
+
+    const char *addr    = getenv((item + "ADDR").c_str());
+    const char *masklen = getenv((item + "MASKLEN").c_str());
+
+    if (not addr or not masklen or not parse_route(std::string(addr) + "/" + masklen, include)) {
+      LOG(ERROR) << "Ignoring malformed " << item << "* route.";
+    }
+  }
+}
+
+static void load_routes_file(std::string const &path)
+{
+  std::ifstream file { path };
+
+  if (not file) {
+    LOG(FATAL) << "Couldn't open " << path << ".";
+  }
+
+  for (std::string line; std::getline(file, line); ) {
+    line.erase(std::remove_if(line.begin(), line.end(), ::isspace), line.end());
+
+    if (line.empty() or line[0] == '#') {
+      continue;
+    }
+
+    bool include = line[0] != '!';
+
+    if (not parse_route(include ? line : line.substr(1), include)) {
+      LOG(ERROR) << path << ": Ignoring malformed route '" << line << "'.";
+    }
+  }
+}
+
+void load_vpn_routes()
+{
+  if (not FLAGS_split_tunnel) {
+    return;
+  }
+
+  load_split_env("CISCO_SPLIT_INC", true);
+  load_split_env("CISCO_SPLIT_EXC", false);
+
+  if (not FLAGS_split_routes_file.empty()) {
+    load_routes_file(FLAGS_split_routes_file);
+  }
+
+  std::stable_sort(routes.begin(), routes.end(), [] (Route const &a, Route const &b) {
+      return a.prefix_len > b.prefix_len;
+    });
+
+  if (not routes.empty()) {
+    LOG(INFO) << "Split tunnel with " << routes.size() << " routes. "
+              << (have_includes ? "Other destinations are connected directly."
+                                : "Only excluded destinations are connected directly.");
+  }
+}
+
+bool split_tunnel_active()
+{
+  return not routes.empty();
+}
+
+bool through_vpn(uint32_t addr)
+{
+  addr = ntohl(addr);
+
+  for (Route const &route : routes) {
+    if ((addr & route.mask) == route.network) {
+      return route.include;
+    }
+  }
+
+  return not have_includes;
+}
+
+// EOF
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+
+// With split tunneling, only some networks are behind the VPN.
+// CONNECTs to anything else bypass lwIP and go through an ordinary
+// kernel socket. See SpliceRelay.
+
+/// Load the split tunnel configuration from openconnect's environment
+/// (CISCO_SPLIT_INC and CISCO_SPLIT_EXC) and --split_routes_file.
+/// Call once at startup.
+void load_vpn_routes();
+
+/// True, if some destinations don't go through the VPN.
+bool split_tunnel_active();
+
+/// True, if addr (in network byte order) is reached through the VPN.
+/// Without any included networks, everything is.
+bool through_vpn(uint32_t addr);
+
+// EOF
@@ -0,0 +1,195 @@
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+#include <cstring>
+#include <system_error>
+
+#include <lwip/tcp.h>
+#include <lwip/udp.h>
+
+#include "shard.hpp"
+
+DEFINE_int32(shards, 1, "Number of lwIP stacks to run, each in its own process on its own TUN queue");
+
+// The dynamic port range lwIP would use on its own.
+static const unsigned LOCAL_PORT_FIRST = 0xC000;
+static const unsigned LOCAL_PORT_COUNT = 0x4000;
+
+static unsigned shards      = 1;
+static unsigned this_shard  = 0;
+static unsigned port_first  = LOCAL_PORT_FIRST;
+static unsigned port_count  = LOCAL_PORT_COUNT;
+static unsigned port_next   = 0;
+
+static void pin_to_cpu(unsigned shard)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus <= 0) {
+    return;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(shard % cpus, &set);
+
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+    PLOG(WARNING) << "Couldn't pin shard " << shard << " to CPU " << (shard % cpus);
+  }
+}
+
+unsigned start_shards(std::function<void ()> before_fork)
+{
+  CHECK_GE(FLAGS_shards, 1);
+  CHECK_LE(unsigned(FLAGS_shards), LOCAL_PORT_COUNT);
+
+  shards = FLAGS_shards;
+
+  before_fork();
+
+  if (shards == 1) {
+    return 0;
+  }
+
+  // The parent process is shard 0.
+  for (unsigned i = 1; i < shards; i++) {
+    pid_t pid = fork();
+
+    if (pid < 0) {
+      throw std::system_error(std::error_code(errno, std::system_category()), "fork");
+    }
+
+    if (pid == 0) {
+      // Don't outlive the parent.
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+      this_shard = i;
+      break;
+    }
+  }
+
+  port_count = LOCAL_PORT_COUNT / shards;
+  port_first = LOCAL_PORT_FIRST + this_shard * port_count;
+
+  pin_to_cpu(this_shard);
+
+  LOG(INFO) << "Shard " << this_shard << " of " << shards << " uses local ports "
+            << port_first << "-" << (port_first + port_count - 1) << ".";
+
+  return this_shard;
+}
+
+unsigned shard_count()
+{
+  return shards;
+}
+
+unsigned shard_index()
+{
+  return this_shard;
+}
+
+static bpf_insn insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+  bpf_insn i;
+  memset(&i, 0, sizeof(i));
+
+  i.code    = code;
+  i.dst_reg = dst;
+  i.src_reg = src;
+  i.off     = off;
+  i.imm     = imm;
+
+  return i;
+}
+
+int shard_steering_program()
+{
+  // The same split as in start_shards().
+  unsigned count = LOCAL_PORT_COUNT / shards;
+
+  // The TUN device has no link layer, so packets start with the IP
+  // header. LD_ABS and LD_IND read from the packet in network byte
+  // order, with the context in r6. Reading past the end returns 0.
+  bpf_insn const prog[] = {
+    /*  0 */ insn(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),
+    /*  1 */ insn(BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, 0),         // Version and IHL.
+    /*  2 */ insn(BPF_ALU64 | BPF_MOV | BPF_X, 7, 0, 0, 0),
+    /*  3 */ insn(BPF_ALU64 | BPF_RSH | BPF_K, 0, 0, 0, 4),
+    /*  4 */ insn(BPF_JMP | BPF_JNE | BPF_K, 0, 0, 13, 4),         // Not IPv4.
+    /*  5 */ insn(BPF_ALU64 | BPF_AND | BPF_K, 7, 0, 0, 0xF),
+    /*  6 */ insn(BPF_ALU64 | BPF_LSH | BPF_K, 7, 0, 0, 2),       // r7 = header length
+    /*  7 */ insn(BPF_LD | BPF_ABS | BPF_H, 0, 0, 0, 6),
+    /*  8 */ insn(BPF_ALU64 | BPF_AND | BPF_K, 0, 0, 0, 0x1FFF),
+    /*  9 */ insn(BPF_JMP | BPF_JNE | BPF_K, 0, 0, 8, 0),          // Fragment without ports.
+    /* 10 */ insn(BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, 9),         // Protocol.
+    /* 11 */ insn(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1, 6),          // TCP
+    /* 12 */ insn(BPF_JMP | BPF_JNE | BPF_K, 0, 0, 5, 17),         // or UDP.
+    /* 13 */ insn(BPF_LD | BPF_IND | BPF_H, 0, 7, 0, 2),         // Destination port.
+    /* 14 */ insn(BPF_ALU64 | BPF_SUB | BPF_K, 0, 0, 0, LOCAL_PORT_FIRST),
+    /* 15 */ insn(BPF_JMP | BPF_JGT | BPF_K, 0, 0, 2, shards * count - 1),
+    /* 16 */ insn(BPF_ALU64 | BPF_DIV | BPF_K, 0, 0, 0, count),
+    /* 17 */ insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    /* 18 */ insn(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, 0),
+    /* 19 */ insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+  };
+
+  static char const license[] = "GPL";
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+
+  attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+  attr.insns     = reinterpret_cast<uintptr_t>(prog);
+  attr.insn_cnt  = sizeof(prog) / sizeof(prog[0]);
+  attr.license   = reinterpret_cast<uintptr_t>(license);
+
+  int fd = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+  if (fd < 0) {
+    throw std::system_error(std::error_code(errno, std::system_category()), "BPF_PROG_LOAD");
+  }
+
+  return fd;
+}
+
+/// Try binding to the ports of our range with bind_fn until one is
+/// free.
+template <typename PCB, typename BIND_FN>
+static bool bind_local_port(PCB *pcb, BIND_FN bind_fn)
+{
+  if (shards == 1) {
+    return true;
+  }
+
+  for (unsigned tries = 0; tries < port_count; tries++) {
+    uint16_t port = port_first + port_next;
+    port_next = (port_next + 1) % port_count;
+
+    err_t err = bind_fn(pcb, IP_ADDR_ANY, port);
+    if (err == ERR_OK) {
+      return true;
+    } else if (err != ERR_USE) {
+      LOG(ERROR) << "Binding to local port failed with " << lwip_strerr(err) << " " << int(err);
+      return false;
+    }
+  }
+
+  LOG(ERROR) << "No free local port left in shard " << this_shard << ".";
+  return false;
+}
+
+bool shard_bind_local_port(struct tcp_pcb *pcb)
+{
+  return bind_local_port(pcb, tcp_bind);
+}
+
+bool shard_bind_local_port(struct udp_pcb *pcb)
+{
+  return bind_local_port(pcb, udp_bind);
+}
+
+// EOF
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+struct tcp_pcb;
+struct udp_pcb;
+
+// With --shards > 1, we run one process per shard. Every process has
+// its own lwIP stack on its own queue of a multi-queue TUN device and
+// accepts SOCKS connections from a shared SO_REUSEPORT socket. The
+// stacks share the IP address, so each shard uses a distinct range of
+// local ports for its connections. A BPF program on the TUN device
+// steers packets to the queue of the shard that owns their
+// destination port.
+
+/// Fork the shard processes and pin each to a CPU. before_fork runs
+/// in the parent first, when shard_count() is already valid. Returns
+/// the index of the shard the calling process is responsible for.
+/// Must be called before any io_service is created.
+unsigned start_shards(std::function<void ()> before_fork);
+
+/// Number of shards. 1 if sharding is disabled.
+unsigned shard_count();
+
+/// The shard the calling process is responsible for.
+unsigned shard_index();
+
+/// Load a BPF program for TUNSETSTEERINGEBPF that returns the index
+/// of the shard that owns the destination port of a TCP or UDP
+/// packet. Everything else goes to shard 0. Returns the program's fd.
+int shard_steering_program();
+
+/// Bind a new lwIP PCB to a free local port of our shard's port range.
+/// Does nothing, if sharding is disabled.
+bool shard_bind_local_port(struct tcp_pcb *pcb);
+bool shard_bind_local_port(struct udp_pcb *pcb);
+
+// EOF
@@ -0,0 +1,237 @@
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <asio/io_service.hpp>
+#include <asio/ip/tcp.hpp>
+
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+#include <cerrno>
+
+#include "splice_relay.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+using asio::ip::tcp;
+
+DEFINE_int32(direct_mark, 0, "Firewall mark (SO_MARK) for direct connections, so iptables rules can exclude them from redirection to --transparent_port. Needs CAP_NET_ADMIN. 0 leaves them unmarked");
+
+SpliceRelay::SpliceRelay(asio::io_service &io, tcp::socket &client,
+                         Counter &bytes_upstream, Counter &bytes_downstream)
+  : io_service(io), remote(io),
+    upstream   { client, remote, bytes_upstream },
+    downstream { remote, client, bytes_downstream }
+{ }
+
+SpliceRelay::~SpliceRelay()
+{
+  for (Direction *d : { &upstream, &downstream }) {
+    for (int fd : d->pipe) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+  }
+}
+
+void SpliceRelay::connect(tcp::endpoint const &destination, callback_t connected)
+{
+  auto self = shared_from_this();
+
+  asio::error_code ec;
+  remote.open(destination.protocol(), ec);
+
+  if (not ec and FLAGS_direct_mark) {
+    int mark = FLAGS_direct_mark;
+
+    // Without the mark, a REDIRECT rule for outgoing connections
+    // would send this connection back to us.
+    if (setsockopt(remote.native_handle(), SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) < 0) {
+      ec = asio::error_code(errno, asio::error::get_system_category());
+    }
+  }
+
+  if (ec) {
+    io_service.post([this, self, connected, ec] {
+        if (not finished) {
+          connected(ec);
+        }
+      });
+    return;
+  }
+
+  remote.async_connect(destination, [this, self, connected] (asio::error_code const &error) {
+      if (finished) {
+        return;
+      }
+
+      if (not error) {
+        asio::error_code ec;
+        remote.set_option(tcp::no_delay(true), ec);
+        remote.non_blocking(true, ec);
+      }
+
+      connected(error);
+    });
+}
+
+bool SpliceRelay::open_pipe(Direction &d)
+{
+  if (pipe2(d.pipe.data(), O_NONBLOCK | O_CLOEXEC) < 0) {
+    return false;
+  }
+
+  // Larger pipes mean fewer splices. Failing is fine.
+  fcntl(d.pipe[1], F_SETPIPE_SZ, int(PIPE_BYTES));
+
+  int size = fcntl(d.pipe[1], F_GETPIPE_SZ);
+  pipe_capacity = size > 0 ? size : 1 << 16;
+
+  return true;
+}
+
+void SpliceRelay::start(callback_t done_cb)
+{
+  done = done_cb;
+
+  if (not open_pipe(upstream) or not open_pipe(downstream)) {
+    finish(asio::error_code(errno, asio::error::get_system_category()));
+    return;
+  }
+
+  pump(upstream);
+  pump(downstream);
+}
+
+void SpliceRelay::close()
+{
+  finished = true;
+  done     = nullptr;
+
+  asio::error_code ec;
+  remote.close(ec);
+}
+
+void SpliceRelay::finish(asio::error_code const &error)
+{
+  if (finished) {
+    return;
+  }
+
+  // done may hold the last reference to our SocksClient, which holds
+  // the last reference to us.
+  auto self = shared_from_this();
+  auto cb   = done;
+
+  close();
+  cb(error);
+}
+
+void SpliceRelay::wait_readable(Direction &d)
+{
+  auto self = shared_from_this();
+
+  d.from.async_read_some(asio::null_buffers(), [this, self, &d] (asio::error_code const &error, size_t) {
+      if (finished) {
+        return;
+      }
+
+      if (error) {
+        finish(error);
+        return;
+      }
+
+      pump(d);
+    });
+}
+
+void SpliceRelay::wait_writable(Direction &d)
+{
+  auto self = shared_from_this();
+
+  d.to.async_write_some(asio::null_buffers(), [this, self, &d] (asio::error_code const &error, size_t) {
+      if (finished) {
+        return;
+      }
+
+      if (error) {
+        finish(error);
+        return;
+      }
+
+      pump(d);
+    });
+}
+
+/// Move data from d.from into the pipe and from there to d.to, until
+/// one of the sockets would block.
+void SpliceRelay::pump(Direction &d)
+{
+  for (unsigned i = 0; i < MAX_SPLICES_PER_WAKEUP; i++) {
+    ssize_t n;
+
+    if (d.in_pipe) {
+      n = splice(d.pipe[0], nullptr, d.to.native_handle(), nullptr, d.in_pipe,
+                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        } else if (errno == EAGAIN) {
+          wait_writable(d);
+        } else {
+          finish(asio::error_code(errno, asio::error::get_system_category()));
+        }
+        return;
+      }
+
+      TRACE << "Spliced " << n << " bytes.";
+
+      d.in_pipe -= n;
+      d.bytes.add(n);
+      continue;
+    }
+
+    if (d.eof) {
+      asio::error_code ec;
+      d.to.shutdown(tcp::socket::shutdown_send, ec);
+      d.done = true;
+
+      if (upstream.done and downstream.done) {
+        finish(asio::error_code());
+      }
+      return;
+    }
+
+    n = splice(d.from.native_handle(), nullptr, d.pipe[1], nullptr, pipe_capacity,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN) {
+        wait_readable(d);
+      } else {
+        finish(asio::error_code(errno, asio::error::get_system_category()));
+      }
+      return;
+    }
+
+    if (n == 0) {
+      d.eof = true;
+    }
+
+    d.in_pipe += n;
+  }
+
+  // There is more, but let other connections run first.
+  auto self = shared_from_this();
+  io_service.post([this, self, &d] {
+      if (not finished) {
+        pump(d);
+      }
+    });
+}
+
+// EOF
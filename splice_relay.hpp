@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <functional>
+#include <memory>
+
+#include <asio/io_service.hpp>
+#include <asio/ip/tcp.hpp>
+
+class Counter;
+
+/// Connects to a destination outside the VPN with an ordinary kernel
+/// socket and relays between it and the SOCKS client with splice(2).
+/// Each direction moves data through its own pipe, so the payload
+/// never enters our address space and lwIP is not involved.
+class SpliceRelay final : public std::enable_shared_from_this<SpliceRelay> {
+public:
+
+  using callback_t = std::function<void (asio::error_code const &error)>;
+
+private:
+
+  enum {
+    // We ask for pipes this large. The kernel may give us less.
+    PIPE_BYTES = 1 << 20,
+
+    // Splices per direction before we let other connections run.
+    MAX_SPLICES_PER_WAKEUP = 16,
+  };
+
+  struct Direction {
+    asio::ip::tcp::socket &from;
+    asio::ip::tcp::socket &to;
+    Counter               &bytes;
+
+    std::array<int, 2> pipe { { -1, -1 } };
+    size_t             in_pipe = 0;
+    bool               eof     = false;
+    bool               done    = false;
+  };
+
+  asio::io_service &io_service;
+
+  // The socket to the destination. The client's socket belongs to the
+  // SocksClient.
+  asio::ip::tcp::socket remote;
+
+  Direction upstream;      // client -> remote
+  Direction downstream;    // remote -> client
+
+  size_t pipe_capacity = 0;
+
+  callback_t done;
+  bool       finished = false;
+
+  bool open_pipe(Direction &d);
+  void pump(Direction &d);
+  void wait_readable(Direction &d);
+  void wait_writable(Direction &d);
+  void finish(asio::error_code const &error);
+
+public:
+
+  /// bytes_upstream and bytes_downstream count relayed bytes.
+  SpliceRelay(asio::io_service &io, asio::ip::tcp::socket &client,
+              Counter &bytes_upstream, Counter &bytes_downstream);
+  ~SpliceRelay();
+
+  static std::shared_ptr<SpliceRelay> create(asio::io_service &io, asio::ip::tcp::socket &client,
+                                             Counter &bytes_upstream, Counter &bytes_downstream)
+  {
+    return std::make_shared<SpliceRelay>(io, client, bytes_upstream, bytes_downstream);
+  }
+
+  void connect(asio::ip::tcp::endpoint const &destination, callback_t connected);
+
+  /// Relay until both directions have passed on their EOF or one of
+  /// them fails. done is called once in the end. The client's socket
+  /// stays open.
+  void start(callback_t done);
+
+  /// Stop relaying and close the socket to the destination. done is
+  /// not called anymore.
+  void close();
+};
+
+// EOF
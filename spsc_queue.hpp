@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+/// A bounded queue for exactly one producer and one consumer thread.
+/// Neither side blocks or takes a lock. Each index is written by one
+/// side only, and the other side reads it with acquire semantics.
+template <typename T>
+class SpscQueue {
+
+  // Written by the consumer.
+  std::atomic<size_t> head { 0 };
+
+  // Keep producer and consumer indices on different cache lines.
+  char padding[64 - sizeof(std::atomic<size_t>)];
+
+  // Written by the producer.
+  std::atomic<size_t> tail { 0 };
+
+  size_t const         mask;
+  std::unique_ptr<T[]> slots;
+
+public:
+
+  /// capacity must be a power of two.
+  explicit SpscQueue(size_t capacity)
+    : mask(capacity - 1), slots(new T[capacity])
+  {}
+
+  SpscQueue(SpscQueue const &) = delete;
+  SpscQueue &operator=(SpscQueue const &) = delete;
+
+  size_t capacity() const { return mask + 1; }
+
+  // Producer side.
+
+  bool full() const
+  {
+    return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire) > mask;
+  }
+
+  /// Returns false, if the queue is full.
+  bool push(T const &value)
+  {
+    size_t t = tail.load(std::memory_order_relaxed);
+
+    if (t - head.load(std::memory_order_acquire) > mask) {
+      return false;
+    }
+
+    slots[t & mask] = value;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side.
+
+  /// The oldest element or nullptr, if the queue is empty. The
+  /// consumer may modify it in place.
+  T *front()
+  {
+    size_t h = head.load(std::memory_order_relaxed);
+
+    if (h == tail.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+
+    return &slots[h & mask];
+  }
+
+  /// Remove the element front() returned.
+  void pop()
+  {
+    head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  /// Returns false, if the queue is empty.
+  bool pop(T &value)
+  {
+    T *f = front();
+
+    if (not f) {
+      return false;
+    }
+
+    value = *f;
+    pop();
+    return true;
+  }
+};
+
+// EOF
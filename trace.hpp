@@ -0,0 +1,23 @@
+#pragma once
+
+#include <atomic>
+
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+// TRACE is for detail about every packet and every read. It is only
+// compiled in with `scons trace=1`. Even then it only prints
+// something with --trace, which SIGUSR1 toggles at runtime. Otherwise
+// the arguments are not evaluated.
+//
+// I/O threads check trace_enabled while the lwIP thread toggles it,
+// so it is atomic. It starts out as --trace.
+
+#ifdef MACGYVERNET_TRACE
+extern std::atomic<bool> trace_enabled;
+# define TRACE LOG_IF(INFO, trace_enabled.load(std::memory_order_relaxed))
+#else
+# define TRACE LOG_IF(INFO, false)
+#endif
+
+// EOF
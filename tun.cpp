@@ -2,28 +2,53 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
 #include <linux/if_tun.h>
+#include <arpa/inet.h>
 
 #include <asio/write.hpp>
 #include <asio/io_service.hpp>
-#include <asio/deadline_timer.hpp>
 #include <asio/posix/stream_descriptor.hpp>
 
 #include <glog/logging.h>
+#include <gflags/gflags.h>
+#include <cstdlib>
+#include <cerrno>
 #include <cstring>
+#include <string>
 #include <array>
+#include <vector>
+#include <memory>
+#include <new>
+#include <algorithm>
 #include <system_error>
 
-#include <lwip/init.h>
 #include <lwip/netif.h>
 #include <lwip/ip.h>
 #include <lwip/pbuf.h>
-#include <lwip/timers.h>
+#include <lwip/inet_chksum.h>
 
 #include "macgyvernet.hpp"
+#include "backend.hpp"
+#include "trace.hpp"
+#include "metrics.hpp"
+#include "shard.hpp"
+#include "vpn_env.hpp"
+#include "uring.hpp"
 
-static int open_tun(const char *name)
+DEFINE_int32(tun_rx_batch, 64, "Maximum number of packets read from the TUN device per wakeup");
+DEFINE_int32(mtu, 1500, "MTU of the TUN device");
+DEFINE_bool(tun_offload, false, "Exchange TCP super-packets of up to 64 KiB with the TUN device (IFF_VNET_HDR)");
+DEFINE_bool(io_uring, false, "Read and write packets through io_uring instead of the reactor. Needs a build with uring=1");
+
+#ifdef MACGYVERNET_IO_URING
+DEFINE_int32(io_uring_rx_buffers, 1024, "Receive buffers the kernel reads packets into with --io_uring. A power of two");
+#endif
+
+static int open_tun(const char *name, bool vnet_hdr)
 {
   struct ifreq ifr;
   int fd, err;
@@ -36,6 +61,17 @@ static int open_tun(const char *name)
 
   ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
 
+  // Every shard has its own queue. See open_tun_queues().
+  if (shard_count() > 1) {
+    ifr.ifr_flags |= IFF_MULTI_QUEUE;
+  }
+
+  // Every packet starts with a virtio_net_hdr that describes GSO and
+  // checksum offloads.
+  if (vnet_hdr) {
+    ifr.ifr_flags |= IFF_VNET_HDR;
+  }
+
   strncpy(ifr.ifr_name, name, IFNAMSIZ);
 
   if ((err = ioctl(fd, TUNSETIFF, (void *) &ifr)) < 0) {
@@ -43,47 +79,505 @@ static int open_tun(const char *name)
     throw std::system_error(std::error_code(errno, std::system_category()), "ioctl");
   }
 
+  // Allow the kernel to hand us TCP/IPv4 packets that are larger than
+  // the MTU and packets with checksums it didn't compute.
+  if (vnet_hdr and ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4) < 0) {
+    close(fd);
+    throw std::system_error(std::error_code(errno, std::system_category()), "TUNSETOFFLOAD");
+  }
+
   LOG(INFO) << ifr.ifr_name << " opened.";
 
   return fd;
 }
 
+// The kernel's struct virtio_net_hdr. linux/virtio_net.h doesn't compile as C++.
+struct VirtioNetHdr {
+  uint8_t  flags;
+  uint8_t  gso_type;
+  uint16_t hdr_len;
+  uint16_t gso_size;
+  uint16_t csum_start;
+  uint16_t csum_offset;
+};
+
+enum {
+  VIRTIO_NET_HDR_F_NEEDS_CSUM = 1,
+
+  VIRTIO_NET_HDR_GSO_NONE  = 0,
+  VIRTIO_NET_HDR_GSO_TCPV4 = 1,
+};
+
+static uint16_t load16(uint8_t const *p)
+{
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return ntohs(v);
+}
+
+static uint32_t load32(uint8_t const *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return ntohl(v);
+}
+
+static void store16(uint8_t *p, uint16_t v)
+{
+  v = htons(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+enum {
+  TCP_FLAG_PSH = 0x08,
+  TCP_FLAG_ACK = 0x10,
+};
+
+/// An outgoing TCP/IPv4 data segment that may become part of a TSO
+/// frame.
+struct TcpSegment {
+  // IP and TCP header. Both are in the first pbuf.
+  uint8_t const *ip;
+  uint16_t       hdr_len;
+
+  uint16_t payload;
+  uint32_t seq;
+  uint8_t  flags;
+};
+
+/// Returns false for anything the kernel can't segment for us: other
+/// protocols, IP options, fragments, segments without data and
+/// segments with flags other than ACK and PSH.
+static bool parse_tcp_segment(pbuf const *p, TcpSegment &seg)
+{
+  auto const *ip = static_cast<uint8_t const *>(p->payload);
+
+  if (p->len < 40 or ip[0] != 0x45 or ip[9] != IP_PROTO_TCP or (load16(ip + 6) & 0x3FFF)) {
+    return false;
+  }
+
+  uint8_t const *tcp = ip + 20;
+  seg.hdr_len = 20 + (tcp[12] >> 4) * 4;
+  seg.flags   = tcp[13];
+
+  if (seg.hdr_len < 40 or p->len < seg.hdr_len or p->tot_len <= seg.hdr_len or
+      seg.flags & ~(TCP_FLAG_ACK | TCP_FLAG_PSH) or not (seg.flags & TCP_FLAG_ACK)) {
+    return false;
+  }
+
+  seg.ip      = ip;
+  seg.payload = p->tot_len - seg.hdr_len;
+  seg.seq     = load32(tcp + 4);
+
+  return true;
+}
+
+/// The Internet checksum of the chain p from offset on. Like
+/// inet_chksum_pbuf, but without moving the payload pointer.
+static u16_t chksum_pbuf_from(pbuf const *p, size_t offset)
+{
+  uint32_t acc     = 0;
+  bool     swapped = false;
+
+  for (; p; p = p->next) {
+    if (offset >= p->len) {
+      offset -= p->len;
+      continue;
+    }
+
+    size_t len = p->len - offset;
+
+    acc += LWIP_CHKSUM(static_cast<uint8_t const *>(p->payload) + offset, len);
+    acc  = (acc >> 16) + (acc & 0xFFFF);
+    offset = 0;
+
+    // An odd part shifts the following bytes into the other half of
+    // the word.
+    if (len % 2) {
+      swapped = not swapped;
+      acc = ((acc & 0xFF) << 8) | ((acc & 0xFF00) >> 8);
+    }
+  }
+
+  if (swapped) {
+    acc = ((acc & 0xFF) << 8) | ((acc & 0xFF00) >> 8);
+  }
+
+  return ~acc & 0xFFFF;
+}
+
+/// The kernel leaves the checksum of packets with
+/// VIRTIO_NET_HDR_F_NEEDS_CSUM to us. The checksum field holds the
+/// pseudo header sum. lwIP verifies checksums, so fill it in.
+static bool complete_checksum(pbuf *p, VirtioNetHdr const &vnet)
+{
+  size_t field = size_t(vnet.csum_start) + vnet.csum_offset;
+
+  if (field + 2 > p->len) {
+    return false;
+  }
+
+  u16_t sum = chksum_pbuf_from(p, vnet.csum_start);
+
+  memcpy(static_cast<uint8_t *>(p->payload) + field, &sum, sizeof(sum));
+  return true;
+}
+
 class TunInterface : public netif {
 
+  asio::io_service              &io;
   asio::posix::stream_descriptor tun_fd;
 
-  std::array<uint8_t, 1500> incoming_buffer;
+  // With offloads, every packet starts with a VirtioNetHdr and
+  // packets can be up to 64 KiB large.
+  bool const vnet_hdr;
+
+  // A PBUF_POOL chain large enough for the largest packet. Packets
+  // are read directly into it.
+  pbuf *rx_pbuf = nullptr;
+
+  // The pbufs the last packet didn't fill. They are kept for the next
+  // read instead of going back to the pool.
+  pbuf *rx_spare = nullptr;
 
-  asio::deadline_timer timer;
+  VirtioNetHdr rx_vnet;
 
-  void read_cb(const asio::error_code &error, size_t len)
+  // Scatter list pointing into rx_vnet and rx_pbuf.
+  std::array<struct iovec, 64> rx_iov;
+  size_t rx_iov_len = 0;
+
+  LwipTimer &timer;
+
+  u16_t const device_mtu;
+
+  enum {
+    // Maximum number of packets waiting for the TUN device to become
+    // writable.
+    TX_QUEUE_CAPACITY = 256,
+
+    // Maximum number of lwIP packets in a TSO frame.
+    TX_MAX_SEGMENTS = 64,
+
+    // Maximum number of buffers in a single write.
+    TX_MAX_IOV = 256,
+  };
+
+  /// One write to the TUN device. Without offloads, this is always a
+  /// single packet from lwIP. With offloads, consecutive segments of a
+  /// TCP connection are sent as one TSO frame and the kernel splits
+  /// them again.
+  struct TxFrame {
+    std::array<pbuf *, TX_MAX_SEGMENTS> segments;
+    unsigned count = 0;
+
+    // IP length of the whole frame.
+    uint32_t bytes = 0;
+
+    VirtioNetHdr vnet;
+
+    // Only TSO frames: headers of the first segment with the length
+    // and checksum of the frame. The headers of the other segments
+    // are skipped.
+    std::array<uint8_t, 80> header;
+    uint16_t header_len = 0;
+  };
+
+  // Ring buffer of frames waiting to be written. Their pbufs are
+  // referenced.
+  std::array<TxFrame, TX_QUEUE_CAPACITY> tx_queue;
+  size_t tx_head  = 0;
+  size_t tx_count = 0;
+
+  // If true, we wait for the TUN device to become writable.
+  bool tx_waiting = false;
+
+  // With --io_uring, reads and writes go through this ring instead of
+  // the reactor.
+  Uring *uring;
+
+#ifdef MACGYVERNET_IO_URING
+  enum {
+    // Buffer group of rx_ring.
+    RX_BUFFER_GROUP = 0,
+
+    // Reads kept in flight. Each completes with one packet.
+    RX_URING_DEPTH = 32,
+  };
+
+  /// A receive buffer the kernel picks from rx_ring. The packet is
+  /// handed to lwIP without copying. The buffer goes back into the
+  /// ring when lwIP frees the pbuf.
+  ///
+  /// The packet data follows this header in rx_memory. lwIP moves
+  /// the payload pointer back over headers it has stripped, which
+  /// only works for PBUF_RAM pbufs with the payload behind the pbuf.
+  struct RxBuffer {
+    struct pbuf_custom pc;
+    TunInterface      *owner;
+    uint16_t           bid;
+  };
+
+  io_uring_buf_ring         *rx_ring = nullptr;
+  std::unique_ptr<uint8_t[]> rx_memory;
+  size_t                     rx_buffer_count = 0;
+  size_t                     rx_buffer_size  = 0;
+  size_t                     rx_buffer_stride = 0;
+  size_t                     rx_buffers_free = 0;
+  unsigned                   rx_reads        = 0;
+
+  RxBuffer *rx_buffer(uint16_t bid)
+  {
+    return reinterpret_cast<RxBuffer *>(rx_memory.get() + bid * rx_buffer_stride);
+  }
+
+  static uint8_t *rx_data(RxBuffer *buffer)
+  {
+    return reinterpret_cast<uint8_t *>(buffer + 1);
+  }
+
+  /// An operation that only has to find its TunInterface.
+  struct OwnerOp {
+    UringOp       op;
+    TunInterface *owner;
+  };
+
+  OwnerOp rx_op;
+
+  // After -EAGAIN, we poll before reading or writing again instead of
+  // retrying right away. Set while the poll is outstanding.
+  OwnerOp rx_poll_op;
+  OwnerOp tx_poll_op;
+  bool    rx_polling = false;
+  bool    tx_polling = false;
+
+  /// The write of the tx_queue slot with the same index.
+  struct TxOp {
+    UringOp       op;
+    TunInterface *owner;
+    size_t        slot;
+    bool          done;
+  };
+
+  std::array<TxOp, TX_QUEUE_CAPACITY> tx_ops;
+
+  // Frames from tx_head on that are submitted. The others wait for
+  // the chain in flight.
+  size_t tx_submitted = 0;
+
+  // Writes in flight. They are linked, so they run in order.
+  size_t tx_chain_len = 0;
+
+  // A write of the chain in flight found the device full.
+  bool tx_wait_writable = false;
+
+  bool tx_chain_posted = false;
+
+  // Set while we wait for room in the submission queue.
+  bool rx_room_wait = false;
+  bool tx_room_wait = false;
+
+  // Gather lists of writes in flight. Only used until the write is
+  // submitted, but one per slot keeps them apart.
+  std::unique_ptr<std::array<struct iovec, TX_MAX_IOV>[]> tx_slot_iov;
+#endif
+
+  // Gather list for the frame that is currently written.
+  std::array<struct iovec, TX_MAX_IOV> tx_iov;
+
+  // The TSO frame lwIP is currently adding segments to. It is
+  // written when a segment doesn't fit or once lwIP is done with the
+  // current event.
+  TxFrame  tso;
+  uint16_t tso_gso_size     = 0;
+  uint16_t tso_last_payload = 0;
+  uint32_t tso_next_seq     = 0;
+  uint8_t  tso_flags        = 0;
+  size_t   tso_iovs         = 0;
+  bool     tso_flush_posted = false;
+
+  uint64_t tx_blocked   = 0;
+  size_t   tx_queue_max = 0;
+
+  // batch_histogram[i] counts wakeups that yielded between 2^(i-1)
+  // and 2^i - 1 packets. Bucket 0 counts wakeups without packets.
+  std::array<uint64_t, 16> batch_histogram {};
+  uint64_t wakeups = 0;
+
+  void record_batch(unsigned packets)
+  {
+    unsigned bucket = 0;
+    while (packets and bucket < batch_histogram.size() - 1) {
+      packets >>= 1;
+      bucket++;
+    }
+
+    batch_histogram[bucket]++;
+
+    if (++wakeups % (1 << 16) == 0) {
+      log_stats();
+    }
+  }
+
+  bool prepare_rx_pbuf()
+  {
+    if (rx_pbuf) {
+      return true;
+    }
+
+    u16_t const capacity = vnet_hdr ? 0xFFFF : mtu;
+
+    pbuf *p = rx_spare;
+    rx_spare = nullptr;
+
+    u16_t have = p ? p->tot_len : 0;
+
+    if (have < capacity) {
+      pbuf *more = pbuf_alloc(PBUF_RAW, capacity - have, PBUF_POOL);
+      if (not more) {
+        rx_spare = p;
+        metrics().pbuf_alloc_failures++;
+        return false;
+      }
+
+      if (p) {
+        pbuf_cat(p, more);
+      } else {
+        p = more;
+      }
+    }
+
+    rx_pbuf = p;
+
+    rx_iov_len = 0;
+    if (vnet_hdr) {
+      rx_iov[rx_iov_len++] = { &rx_vnet, sizeof(rx_vnet) };
+    }
+
+    for (pbuf *c = rx_pbuf; c; c = c->next) {
+      CHECK_LT(rx_iov_len, rx_iov.size()) << "Packets too large for PBUF_POOL_BUFSIZE.";
+      rx_iov[rx_iov_len++] = { c->payload, c->len };
+    }
+
+    return true;
+  }
+
+  void packet_received(size_t len)
+  {
+    TRACE << "Got packet " << len;
+
+    if (vnet_hdr) {
+      len = len < sizeof(rx_vnet) ? 0 : len - sizeof(rx_vnet);
+    }
+
+    if (len == 0) {
+      // Keep rx_pbuf for the next packet.
+      return;
+    }
+
+    metrics().tun_rx_packets++;
+    metrics().tun_rx_bytes.add(len);
+
+    pbuf *p = rx_pbuf;
+    rx_pbuf = nullptr;
+
+    // Split off the pbufs the packet didn't touch and trim the rest to
+    // the packet size.
+    pbuf *last = p;
+    for (size_t filled = last->len; filled < len; filled += last->len) {
+      last = last->next;
+    }
+
+    rx_spare   = last->next;
+    last->next = nullptr;
+
+    pbuf_realloc(p, len);
+
+    deliver(p, vnet_hdr ? &rx_vnet : nullptr);
+  }
+
+  /// Hand a received packet to lwIP. vnet is its virtio_net_hdr, if
+  /// offloads are on.
+  void deliver(pbuf *p, VirtioNetHdr const *vnet)
+  {
+    if (vnet) {
+      // Super-packets are a single large TCP segment. lwIP takes them
+      // as they are.
+      if (vnet->gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+        metrics().tun_rx_gso_packets++;
+      }
+
+      if ((vnet->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) and not complete_checksum(p, *vnet)) {
+        LOG_EVERY_N(ERROR, 1000) << "Dropped packet with an unexpected checksum offset.";
+        metrics().tun_rx_dropped++;
+        pbuf_free(p);
+        return;
+      }
+    }
+
+    if (input(p, this) != ERR_OK) {
+      pbuf_free(p);
+    }
+  }
+
+  // Wait until the TUN device is readable. The actual reads happen
+  // in read_cb.
+  void start_read()
+  {
+#ifdef MACGYVERNET_IO_URING
+    if (uring) {
+      uring_start();
+      return;
+    }
+#endif
+
+    tun_fd.async_read_some(asio::null_buffers(), ASIO_CB(read_cb));
+  }
+
+  void read_cb(const asio::error_code &error, size_t)
   {
     if (error) {
       LOG(ERROR) << "Error reading packet";
       return;
     }
 
-    LOG(INFO) << "Got packet " << len;
+    // Drain as many packets as we can before going back to the
+    // reactor, but don't starve everything else.
+    unsigned packets = 0;
 
-    // XXX This could be optimized, if asio::buffer has some readv
-    // like features. Need to check.
+    while (packets < unsigned(FLAGS_tun_rx_batch)) {
+      ssize_t len;
 
-    pbuf *p = pbuf_alloc(PBUF_IP, len, PBUF_POOL);
-    if (p) {
-      uint8_t *data = incoming_buffer.data();
+      if (not prepare_rx_pbuf()) {
+        // Read the packet anyway. Otherwise, we would spin on it.
+        uint8_t discard;
+        len = ::read(tun_fd.native_handle(), &discard, sizeof(discard));
 
-      // We allocated a buffer chain. Copy packet data.
-      for (pbuf *c = p; c; c = c->next) {
-        memcpy(c->payload, data, c->len);
-        data += c->len;
+        if (len >= 0) {
+          LOG_EVERY_N(ERROR, 1000) << "Dropped packet, because no pbuf was available.";
+          metrics().tun_rx_dropped++;
+          packets++;
+          continue;
+        }
+      } else {
+        len = ::readv(tun_fd.native_handle(), rx_iov.data(), rx_iov_len);
       }
 
-      input(p, this);
-    } else {
-      LOG(ERROR) << "Dropped packet, because no pbuf was available.";
+      if (len < 0) {
+        if (errno == EINTR) {
+          continue;
+        } else if (errno != EAGAIN and errno != EWOULDBLOCK) {
+          PLOG_EVERY_N(ERROR, 1000) << "Error reading packet";
+        }
+        break;
+      }
+
+      packets++;
+      packet_received(len);
     }
 
-    tun_fd.async_read_some(asio::buffer(incoming_buffer), ASIO_CB(read_cb));
+    record_batch(packets);
+    timer.schedule();
+    start_read();
   }
 
   err_t netif_init()
@@ -92,44 +586,726 @@ class TunInterface : public netif {
 
     name[0] = 't';
     name[1] = 'u';
-    output = &TunInterface::static_packet_output;
+    mtu     = device_mtu;
+    output  = &TunInterface::static_packet_output;
 
-    tun_fd.async_read_some(asio::buffer(incoming_buffer), ASIO_CB(read_cb));
+    start_read();
 
     return ERR_OK;
   }
 
+  /// Append the pbuf chain p to iov, starting skip bytes into it.
+  /// Returns false, if iov is full.
+  static bool gather(pbuf const *p, size_t skip, struct iovec *iov, size_t &iov_len)
+  {
+    for (pbuf const *c = p; c; c = c->next) {
+      if (skip >= c->len) {
+        skip -= c->len;
+        continue;
+      }
+
+      if (iov_len == TX_MAX_IOV) {
+        return false;
+      }
+
+      iov[iov_len++] = { static_cast<uint8_t *>(c->payload) + skip, size_t(c->len - skip) };
+      skip = 0;
+    }
+
+    return true;
+  }
+
+  /// Fill iov, which has room for TX_MAX_IOV entries, with the
+  /// buffers of f. Returns the number of entries or 0, if f is
+  /// dropped.
+  size_t gather_frame(TxFrame const &f, struct iovec *iov)
+  {
+    size_t iov_len = 0;
+
+    if (vnet_hdr) {
+      iov[iov_len++] = { const_cast<VirtioNetHdr *>(&f.vnet), sizeof(f.vnet) };
+    }
+
+    bool fits;
+
+    if (f.header_len) {
+      iov[iov_len++] = { const_cast<uint8_t *>(f.header.data()), f.header_len };
+
+      fits = true;
+      for (unsigned i = 0; fits and i < f.count; i++) {
+        fits = gather(f.segments[i], f.header_len, iov, iov_len);
+      }
+    } else {
+      fits = gather(f.segments[0], 0, iov, iov_len);
+    }
+
+    if (not fits) {
+      LOG_EVERY_N(ERROR, 1000) << "Dropped packet, because it consists of too many pbufs.";
+      metrics().tun_tx_dropped++;
+      return 0;
+    }
+
+    return iov_len;
+  }
+
+  static void frame_written(TxFrame const &f)
+  {
+    Metrics &m = metrics();
+    m.tun_tx_packets++;
+    m.tun_tx_bytes.add(f.bytes);
+
+    if (f.header_len) {
+      m.tun_tx_tso_frames++;
+    }
+  }
+
+  /// Write a single frame to the TUN device. Returns false, if the
+  /// device is not writable right now.
+  bool write_frame(TxFrame const &f)
+  {
+    size_t iov_len = gather_frame(f, tx_iov.data());
+
+    if (iov_len == 0) {
+      return true;
+    }
+
+    while (::writev(tun_fd.native_handle(), tx_iov.data(), iov_len) < 0) {
+      if (errno == EAGAIN or errno == EWOULDBLOCK) {
+        return false;
+      } else if (errno != EINTR) {
+        PLOG_EVERY_N(ERROR, 1000) << "Error while sending packet";
+        metrics().tun_tx_dropped++;
+        return true;
+      }
+    }
+
+    frame_written(f);
+    return true;
+  }
+
+  static void free_frame(TxFrame &f)
+  {
+    for (unsigned i = 0; i < f.count; i++) {
+      pbuf_free(f.segments[i]);
+    }
+
+    f.count = 0;
+  }
+
+  /// Write queued frames in order until the queue is empty or the TUN
+  /// device would block.
+  void flush_tx_queue()
+  {
+    while (tx_count) {
+      TxFrame &f = tx_queue[tx_head];
+
+      if (not write_frame(f)) {
+        wait_writable();
+        return;
+      }
+
+      free_frame(f);
+      tx_head = (tx_head + 1) % tx_queue.size();
+      tx_count--;
+    }
+  }
+
+  void wait_writable()
+  {
+    tx_waiting = true;
+    tx_blocked++;
+
+    tun_fd.async_write_some(asio::null_buffers(),
+                            [this] (const asio::error_code &error, size_t) {
+                              tx_waiting = false;
+
+                              if (error) {
+                                LOG(ERROR) << "Error while waiting for TUN device: " << error;
+                                return;
+                              }
+
+                              flush_tx_queue();
+                            });
+  }
+
+  /// Write f or queue it, if other frames are waiting. Its pbufs must
+  /// be referenced and the queue must have room.
+  void send_frame(TxFrame &f)
+  {
+    if (not uring and tx_count == 0 and write_frame(f)) {
+      free_frame(f);
+      return;
+    }
+
+    CHECK_LT(tx_count, tx_queue.size());
+
+    size_t slot = (tx_head + tx_count) % tx_queue.size();
+    tx_queue[slot] = f;
+    f.count = 0;
+
+    queued(slot);
+  }
+
+  /// The frame in slot was added to the end of the queue.
+  void queued(size_t slot)
+  {
+    tx_count++;
+    tx_queue_max = std::max(tx_queue_max, tx_count);
+
+#ifdef MACGYVERNET_IO_URING
+    if (uring) {
+      // Frames queued during this handler go out as one chain.
+      if (not tx_chain_posted) {
+        tx_chain_posted = true;
+        io.post([this] {
+            tx_chain_posted = false;
+            uring_write_chain();
+          });
+      }
+      return;
+    }
+#endif
+
+    if (not tx_waiting) {
+      wait_writable();
+    }
+  }
+
+  /// Try to add seg to the open TSO frame. The kernel cuts the frame
+  /// into gso_size pieces, so all segments except the last must be
+  /// as large as the first. Everything but the sequence number and
+  /// PSH must match the first segment.
+  bool tso_append(pbuf *p, TcpSegment const &seg)
+  {
+    if (tso.count == 0 or tso.count == tso.segments.size()) {
+      return false;
+    }
+
+    auto const *first = static_cast<uint8_t const *>(tso.segments[0]->payload);
+    size_t      iovs  = pbuf_clen(p);
+
+    bool fits = seg.hdr_len == tso.header_len and
+      tso_last_payload == tso_gso_size and seg.payload <= tso_gso_size and
+      seg.seq == tso_next_seq and
+      tso.bytes + seg.payload <= 0xFFFF and
+      tso_iovs + iovs <= tx_iov.size() and
+      // TOS, TTL and addresses.
+      first[1] == seg.ip[1] and first[8] == seg.ip[8] and memcmp(first + 12, seg.ip + 12, 8) == 0 and
+      // Ports.
+      memcmp(first + 20, seg.ip + 20, 4) == 0 and
+      // Acknowledgment, window and options.
+      memcmp(first + 28, seg.ip + 28, 4) == 0 and memcmp(first + 34, seg.ip + 34, 2) == 0 and
+      memcmp(first + 40, seg.ip + 40, seg.hdr_len - 40) == 0;
+
+    if (not fits) {
+      return false;
+    }
+
+    pbuf_ref(p);
+    tso.segments[tso.count++] = p;
+    tso.bytes        += seg.payload;
+    tso_last_payload  = seg.payload;
+    tso_next_seq     += seg.payload;
+    tso_flags        |= seg.flags;
+    tso_iovs         += iovs;
+
+    return true;
+  }
+
+  void tso_start(pbuf *p, TcpSegment const &seg)
+  {
+    pbuf_ref(p);
+    tso.segments[0]  = p;
+    tso.count        = 1;
+    tso.bytes        = p->tot_len;
+    tso.header_len   = seg.hdr_len;
+    tso_gso_size     = seg.payload;
+    tso_last_payload = seg.payload;
+    tso_next_seq     = seg.seq + seg.payload;
+    tso_flags        = seg.flags;
+    tso_iovs         = 2 + pbuf_clen(p);
+
+    // lwIP sends everything it has in one go, so the frame is complete
+    // once the current handler returns.
+    if (not tso_flush_posted) {
+      tso_flush_posted = true;
+      io.post([this] {
+          tso_flush_posted = false;
+          tso_close();
+        });
+    }
+  }
+
+  /// Send the open TSO frame. A frame with a single segment goes out
+  /// unchanged.
+  void tso_close()
+  {
+    if (tso.count == 0) {
+      return;
+    }
+
+    memset(&tso.vnet, 0, sizeof(tso.vnet));
+
+    if (tso.count == 1) {
+      tso.header_len = 0;
+      send_frame(tso);
+      return;
+    }
+
+    memcpy(tso.header.data(), tso.segments[0]->payload, tso.header_len);
+
+    uint8_t *ip  = tso.header.data();
+    uint8_t *tcp = ip + 20;
+
+    store16(ip + 2, tso.bytes);
+    store16(ip + 10, 0);
+    u16_t ip_sum = inet_chksum(ip, 20);
+    memcpy(ip + 10, &ip_sum, sizeof(ip_sum));
+
+    // The kernel clears PSH on all but the last segment.
+    tcp[13] |= tso_flags & TCP_FLAG_PSH;
+
+    // The kernel computes the checksum of each segment. It expects the
+    // pseudo header sum, not complemented, in the checksum field.
+    uint8_t pseudo[12];
+    memcpy(pseudo, ip + 12, 8);
+    pseudo[8] = 0;
+    pseudo[9] = IP_PROTO_TCP;
+    store16(pseudo + 10, tso.bytes - 20);
+
+    u16_t pseudo_sum = ~inet_chksum(pseudo, sizeof(pseudo));
+    memcpy(tcp + 16, &pseudo_sum, sizeof(pseudo_sum));
+
+    tso.vnet.flags       = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    tso.vnet.gso_type    = VIRTIO_NET_HDR_GSO_TCPV4;
+    tso.vnet.hdr_len     = tso.header_len;
+    tso.vnet.gso_size    = tso_gso_size;
+    tso.vnet.csum_start  = 20;
+    tso.vnet.csum_offset = 16;
+
+    send_frame(tso);
+  }
+
   err_t packet_output(netif *netif, pbuf *p, ip_addr_t const *ipaddr)
   {
     CHECK_EQ(netif, this);
 
+    TRACE << "lwIP sends " << int(p->tot_len) << " bytes.";
+
+    // Sending may have started retransmission or other timers.
+    timer.schedule();
+
+    TcpSegment seg;
+    bool       tcp_data = vnet_hdr and parse_tcp_segment(p, seg);
+
+    if (tcp_data and tso_append(p, seg)) {
+      return ERR_OK;
+    }
+
+    // Keep packets in order.
+    tso_close();
+
+    if (not uring and tx_count == 0 and not tcp_data) {
+      // If nothing is queued, we can write right away and lwIP keeps
+      // ownership of the pbuf.
+      TxFrame &f = tx_queue[tx_head];
+      f.segments[0] = p;
+      f.count       = 1;
+      f.bytes       = p->tot_len;
+      f.header_len  = 0;
+      memset(&f.vnet, 0, sizeof(f.vnet));
+
+      bool written = write_frame(f);
+      f.count = 0;
+
+      if (written) {
+        return ERR_OK;
+      }
+    }
+
+    if (tx_count == tx_queue.size()) {
+      LOG_EVERY_N(ERROR, 1000) << "Dropped packet, because the transmit queue is full.";
+      metrics().tun_tx_dropped++;
+      return ERR_MEM;
+    }
+
+    if (tcp_data) {
+      tso_start(p, seg);
+      return ERR_OK;
+    }
+
     // Mark buffer as still being in use.
     pbuf_ref(p);
 
-    std::vector<asio::const_buffer> gather_list;
+    size_t   slot = (tx_head + tx_count) % tx_queue.size();
+    TxFrame &f    = tx_queue[slot];
+    f.segments[0] = p;
+    f.count       = 1;
+    f.bytes       = p->tot_len;
+    f.header_len  = 0;
+    memset(&f.vnet, 0, sizeof(f.vnet));
+
+    queued(slot);
+
+    return ERR_OK;
+  }
+
+#ifdef MACGYVERNET_IO_URING
+  void uring_start()
+  {
+    size_t buffers = FLAGS_io_uring_rx_buffers;
+    CHECK(buffers and buffers <= 32768 and (buffers & (buffers - 1)) == 0)
+      << "--io_uring_rx_buffers must be a power of two up to 32768.";
 
-    for (pbuf *c = p; c; c = c->next) {
-      gather_list.emplace_back(c->payload, c->len);
+    rx_buffer_count  = buffers;
+    rx_buffer_size   = vnet_hdr ? sizeof(VirtioNetHdr) + 0xFFFF : mtu;
+    rx_buffer_stride = (sizeof(RxBuffer) + rx_buffer_size + 63) & ~size_t(63);
+    rx_memory.reset(new uint8_t[buffers * rx_buffer_stride]);
+
+    int err;
+    rx_ring = io_uring_setup_buf_ring(uring->get(), buffers, RX_BUFFER_GROUP, 0, &err);
+    if (not rx_ring) {
+      throw std::system_error(std::error_code(-err, std::system_category()), "io_uring_setup_buf_ring");
     }
 
-    LOG(INFO) << "lwIP sends " << int(p->tot_len) << " bytes in " << gather_list.size() << " buffers.";
+    for (size_t i = 0; i < buffers; i++) {
+      RxBuffer *buffer = new (rx_buffer(i)) RxBuffer;
+      buffer->owner = this;
+      buffer->bid   = i;
+      rx_buffer_put(i);
+    }
 
-    asio::async_write(tun_fd, gather_list,
-                      [p] (const asio::error_code &error, size_t len) {
-                        if (error) {
-                          LOG(ERROR) << "Error while sending packet: " << error;
-                        }
-                        pbuf_free(p);
-                      });
+    rx_op      = { { &TunInterface::static_read_done }, this };
+    rx_poll_op = { { &TunInterface::static_readable }, this };
+    tx_poll_op = { { &TunInterface::static_writable }, this };
 
-    return ERR_OK;
+    tx_slot_iov.reset(new std::array<struct iovec, TX_MAX_IOV>[tx_queue.size()]);
+    for (size_t i = 0; i < tx_ops.size(); i++) {
+      tx_ops[i] = { { &TunInterface::static_write_done }, this, i, true };
+    }
+
+    uring_read();
   }
 
+  /// Give a receive buffer back to the kernel.
+  void rx_buffer_put(uint16_t bid)
+  {
+    io_uring_buf_ring_add(rx_ring, rx_data(rx_buffer(bid)), rx_buffer_size, bid,
+                          io_uring_buf_ring_mask(rx_buffer_count), 0);
+    io_uring_buf_ring_advance(rx_ring, 1);
+
+    rx_buffers_free++;
+  }
+
+  static void rx_buffer_free(pbuf *p)
+  {
+    auto *buffer = reinterpret_cast<RxBuffer *>(reinterpret_cast<pbuf_custom *>(p));
+    TunInterface *self = buffer->owner;
+
+    self->rx_buffer_put(buffer->bid);
+
+    // Reads that found no buffer were not restarted.
+    self->uring_read();
+  }
+
+  /// Keep RX_URING_DEPTH reads in flight. The kernel picks their
+  /// buffers, when packets arrive.
+  void uring_read()
+  {
+    if (rx_polling) {
+      return;
+    }
+
+    while (rx_reads < RX_URING_DEPTH and rx_reads < rx_buffers_free) {
+      io_uring_sqe *sqe = uring->get_sqe(&rx_op.op);
+
+      if (not sqe) {
+        if (not rx_room_wait) {
+          rx_room_wait = true;
+          uring->when_room([this] {
+              rx_room_wait = false;
+              uring_read();
+            });
+        }
+        return;
+      }
+
+      io_uring_prep_read(sqe, tun_fd.native_handle(), nullptr, rx_buffer_size, 0);
+
+      sqe->flags     |= IOSQE_BUFFER_SELECT;
+      sqe->buf_group  = RX_BUFFER_GROUP;
+
+      rx_reads++;
+    }
+  }
+
+  void read_done(int res, unsigned flags)
+  {
+    rx_reads--;
+
+    if (res == -EAGAIN) {
+      if (not rx_polling) {
+        rx_wait_readable();
+      }
+      return;
+    }
+
+    if (res <= 0) {
+      if (res < 0 and res != -ENOBUFS and res != -EINTR) {
+        LOG_EVERY_N(ERROR, 1000) << "Error reading packet: "
+                                 << std::error_code(-res, std::system_category()).message();
+      }
+
+      uring_read();
+      return;
+    }
+
+    CHECK(flags & IORING_CQE_F_BUFFER);
+
+    uint16_t  bid    = flags >> IORING_CQE_BUFFER_SHIFT;
+    RxBuffer *buffer = rx_buffer(bid);
+    uint8_t  *data   = rx_data(buffer);
+    size_t    len    = res;
+
+    rx_buffers_free--;
+
+    VirtioNetHdr vnet;
+
+    if (vnet_hdr) {
+      memcpy(&vnet, data, std::min(len, sizeof(vnet)));
+
+      len   = len < sizeof(vnet) ? 0 : len - sizeof(vnet);
+      data += sizeof(vnet);
+    }
+
+    pbuf *p = nullptr;
+
+    if (len == 0) {
+      rx_buffer_put(bid);
+    } else if (rx_buffers_free < rx_buffer_count / 4) {
+      // lwIP and slow clients hold on to received pbufs. Copy, before
+      // the kernel runs out of buffers.
+      p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+      if (p) {
+        pbuf_take(p, data, len);
+      } else {
+        metrics().pbuf_alloc_failures++;
+        metrics().tun_rx_dropped++;
+      }
+
+      rx_buffer_put(bid);
+    } else {
+      buffer->pc.custom_free_function = rx_buffer_free;
+
+      // This doesn't allocate.
+      p = pbuf_alloced_custom(PBUF_RAW, len, PBUF_RAM, &buffer->pc, data, len);
+    }
+
+    uring_read();
+
+    if (p) {
+      TRACE << "Got packet " << len;
+
+      metrics().tun_rx_packets++;
+      metrics().tun_rx_bytes.add(len);
+
+      deliver(p, vnet_hdr ? &vnet : nullptr);
+      timer.schedule();
+    }
+  }
+
+  /// Submit the frames that are queued, but not submitted, as one
+  /// chain of linked writes. A linked write only starts, when the one
+  /// before it is done. Otherwise a write that waits for the device
+  /// would let later frames pass it. For the same reason, only one
+  /// chain is in flight.
+  void uring_write_chain()
+  {
+    if (tx_polling) {
+      return;
+    }
+
+    while (tx_chain_len == 0 and tx_submitted < tx_count) {
+      size_t n = std::min<size_t>(tx_count - tx_submitted, uring->space_left());
+
+      if (n == 0) {
+        if (not tx_room_wait) {
+          tx_room_wait = true;
+          uring->when_room([this] {
+              tx_room_wait = false;
+              uring_write_chain();
+            });
+        }
+        return;
+      }
+
+      io_uring_sqe *prev = nullptr;
+
+      for (size_t i = 0; i < n; i++) {
+        size_t        slot = (tx_head + tx_submitted++) % tx_queue.size();
+        TxOp         &op   = tx_ops[slot];
+        struct iovec *iov  = tx_slot_iov[slot].data();
+        size_t        len  = gather_frame(tx_queue[slot], iov);
+
+        // Dropped frames just have to leave the queue.
+        op.done = len == 0;
+        if (op.done) {
+          continue;
+        }
+
+        // There is room, so this doesn't submit the chain early.
+        io_uring_sqe *sqe = uring->get_sqe(&op.op);
+        io_uring_prep_writev(sqe, tun_fd.native_handle(), iov, len, 0);
+
+        if (prev) {
+          prev->flags |= IOSQE_IO_LINK;
+        }
+
+        prev = sqe;
+        tx_chain_len++;
+      }
+
+      release_written();
+    }
+  }
+
+  /// Frames leave the queue in order, once they are written.
+  void release_written()
+  {
+    while (tx_count and tx_submitted and tx_ops[tx_head].done) {
+      free_frame(tx_queue[tx_head]);
+      tx_head = (tx_head + 1) % tx_queue.size();
+      tx_count--;
+      tx_submitted--;
+    }
+  }
+
+  void write_done(size_t slot, int res)
+  {
+    tx_chain_len--;
+
+    // A failed write cancels the rest of its chain. Cancelled frames
+    // and frames that found the device full go out with the next
+    // chain. Only the frame that failed otherwise is dropped.
+    if (res == -EAGAIN or res == -ECANCELED) {
+      tx_wait_writable |= res == -EAGAIN;
+    } else {
+      if (res < 0) {
+        LOG_EVERY_N(ERROR, 1000) << "Error while sending packet: "
+                                 << std::error_code(-res, std::system_category()).message();
+        metrics().tun_tx_dropped++;
+      } else if (res > 0) {
+        frame_written(tx_queue[slot]);
+      }
+
+      tx_ops[slot].done = true;
+      release_written();
+    }
+
+    if (tx_chain_len) {
+      return;
+    }
+
+    // Frames of the chain that are left were not written. They are
+    // at the head of the queue now.
+    tx_submitted = 0;
+
+    if (tx_wait_writable) {
+      tx_wait_writable = false;
+      tx_wait_writable_poll();
+      return;
+    }
+
+    uring_write_chain();
+  }
+
+  /// Submit a poll for events on the TUN device. op completes, when
+  /// they are there.
+  bool submit_poll(OwnerOp &op, unsigned events)
+  {
+    io_uring_sqe *sqe = uring->get_sqe(&op.op);
+
+    if (not sqe) {
+      return false;
+    }
+
+    io_uring_prep_poll_add(sqe, tun_fd.native_handle(), events);
+    return true;
+  }
+
+  void rx_wait_readable()
+  {
+    rx_polling = true;
+
+    if (not submit_poll(rx_poll_op, POLLIN)) {
+      uring->when_room([this] { rx_wait_readable(); });
+    }
+  }
+
+  void tx_wait_writable_poll()
+  {
+    tx_polling = true;
+
+    if (not submit_poll(tx_poll_op, POLLOUT)) {
+      uring->when_room([this] { tx_wait_writable_poll(); });
+    }
+  }
+
+  static void static_readable(UringOp *op, int, unsigned)
+  {
+    TunInterface *self = reinterpret_cast<OwnerOp *>(op)->owner;
+
+    self->rx_polling = false;
+    self->uring_read();
+  }
+
+  static void static_writable(UringOp *op, int, unsigned)
+  {
+    TunInterface *self = reinterpret_cast<OwnerOp *>(op)->owner;
+
+    self->tx_polling = false;
+    self->uring_write_chain();
+  }
+
+  static void static_read_done(UringOp *op, int res, unsigned flags)
+  {
+    reinterpret_cast<OwnerOp *>(op)->owner->read_done(res, flags);
+  }
+
+  static void static_write_done(UringOp *op, int res, unsigned)
+  {
+    auto *tx = reinterpret_cast<TxOp *>(op);
+    tx->owner->write_done(tx->slot, res);
+  }
+#endif
+
 public:
-  TunInterface(asio::io_service &io, int fd)
-    : tun_fd(io, fd), timer(io)
+  /// fd is a TUN device or anything else that exchanges one IP
+  /// packet per read and write. With vnet_hdr, fd is a TUN device
+  /// opened with IFF_VNET_HDR. With uring, all I/O goes through it.
+  TunInterface(asio::io_service &io, int fd, unsigned mtu, LwipTimer &timer,
+               bool vnet_hdr = false, Uring *uring = nullptr)
+    : io(io), tun_fd(io, fd), vnet_hdr(vnet_hdr), timer(timer), device_mtu(mtu), uring(uring)
   {
     memset(static_cast<netif *>(this), 0, sizeof(netif));
+
+    // The TUN device doesn't support non-blocking io_uring reads. With
+    // O_NONBLOCK, they would fail with EAGAIN instead of waiting.
+    tun_fd.non_blocking(not uring);
+  }
+
+  void log_stats() const
+  {
+    LOG(INFO) << "TUN transmit: " << metrics().tun_tx_dropped.get() << " dropped, blocked " << tx_blocked
+              << " times, at most " << tx_queue_max << " packets queued.";
+
+    LOG(INFO) << "TUN packets per wakeup after " << wakeups << " wakeups:";
+
+    for (size_t i = 0; i < batch_histogram.size(); i++) {
+      if (batch_histogram[i]) {
+        LOG(INFO) << "  < " << (1U << i) << ": " << batch_histogram[i];
+      }
+    }
   }
 
   static err_t static_netif_init(netif *netif)
@@ -141,33 +1317,102 @@ public:
   {
     return static_cast<TunInterface *>(netif)->packet_output(netif, p, ipaddr);
   }
+};
 
-  void start_timer()
-  {
-    timer.expires_from_now(boost::posix_time::milliseconds(100));
-    timer.async_wait([this] (const asio::error_code &err) {
-        if (err) {
-          LOG(ERROR) << "Timer error: " << err;
-          return;
-        }
+/// The MTU openconnect negotiated or --mtu, if it didn't tell us or
+/// the value makes no sense.
+static unsigned vpn_mtu()
+{
+  std::string value = vpn_setting("INTERNAL_IP4_MTU", "X-CSTP-MTU");
 
-        sys_check_timeouts();
-        start_timer();
-      });
+  if (value.empty()) {
+    return FLAGS_mtu;
   }
-};
 
-void initialize_backend(asio::io_service &io)
+  char *end;
+  errno = 0;
+  unsigned long mtu = strtoul(value.c_str(), &end, 10);
+
+  // IPv4 needs at least 68 bytes. lwIP's MTU is 16 bits.
+  if (errno or end == value.c_str() or *end or mtu < 68 or mtu > 0xFFFF) {
+    LOG(ERROR) << "Ignoring invalid MTU '" << value << "' from openconnect. Using " << FLAGS_mtu << ".";
+    return FLAGS_mtu;
+  }
+
+  return mtu;
+}
+
+/// The io_uring for --io_uring. It lives as long as the process.
+static Uring *create_uring(asio::io_service &io)
 {
-  int fd = open_tun("lwip0");
-  CHECK(fd >= 0);
+  if (not FLAGS_io_uring) {
+    return nullptr;
+  }
 
-  static TunInterface tunif { io, fd };
+#ifdef MACGYVERNET_IO_URING
+  return new Uring(io);
+#else
+  LOG(FATAL) << "--io_uring needs a build with uring=1.";
+  return nullptr;
+#endif
+}
 
-  lwip_init();
+// With --shards, queue i of the TUN device belongs to shard i. The
+// kernel numbers queues in the order they are attached, so the parent
+// opens all of them before forking.
+static std::vector<int> tun_queues;
 
+void open_tun_queues()
+{
+  if (shard_count() == 1) {
+    return;
+  }
 
-  LOG(INFO) << "lwIP initialized. Version: " << std::hex << LWIP_VERSION;
+  for (unsigned i = 0; i < shard_count(); i++) {
+    tun_queues.push_back(open_tun("lwip0", FLAGS_tun_offload));
+  }
+
+  // Without this, the kernel picks queues by its flow cache. Its
+  // entries expire after a few seconds without outgoing packets, and
+  // the next packet of an idle connection ends up in a shard that
+  // doesn't know the connection.
+  int prog = shard_steering_program();
+
+  if (ioctl(tun_queues[0], TUNSETSTEERINGEBPF, &prog) < 0) {
+    throw std::system_error(std::error_code(errno, std::system_category()), "TUNSETSTEERINGEBPF");
+  }
+
+  // The device holds its own reference.
+  close(prog);
+
+  LOG(INFO) << "Steering packets to " << shard_count() << " TUN queues by destination port.";
+}
+
+netif *create_tun_backend(asio::io_service &io, LwipTimer &timer)
+{
+#ifndef MACGYVERNET_SERVER_PROFILE
+  // A single super-packet would use up the default pbuf pool.
+  CHECK(not FLAGS_tun_offload) << "--tun_offload needs lwIP built with profile=server.";
+#endif
+
+  int fd;
+
+  if (tun_queues.empty()) {
+    fd = open_tun("lwip0", FLAGS_tun_offload);
+  } else {
+    fd = tun_queues[shard_index()];
+
+    // A queue stays attached, as long as any process has it open.
+    for (int q : tun_queues) {
+      if (q != fd) {
+        close(q);
+      }
+    }
+  }
+
+  CHECK(fd >= 0);
+
+  static TunInterface tunif { io, fd, unsigned(FLAGS_mtu), timer, FLAGS_tun_offload, create_uring(io) };
 
   ip_addr_t ipaddr, netmask, gw;
 
@@ -178,12 +1423,53 @@ void initialize_backend(asio::io_service &io)
   netif_add(&tunif, &ipaddr, &netmask, &gw, &tunif,
             &TunInterface::static_netif_init, ip4_input);
 
-  netif_set_default(&tunif);
-  netif_set_up(&tunif);
-  netif_set_link_up(&tunif);
+  return &tunif;
+}
+
+/// Parse an IPv4 address from openconnect's environment.
+static bool vpn_address(char const *env_name, std::string const &cstp_name, ip_addr_t *addr)
+{
+  std::string value = vpn_setting(env_name, cstp_name);
+  return not value.empty() and ipaddr_aton(value.c_str(), addr);
+}
+
+netif *create_script_tun_backend(asio::io_service &io, LwipTimer &timer)
+{
+  // There is only one socket, so there is nothing to spread over
+  // shards.
+  CHECK_EQ(shard_count(), 1U) << "The script-tun backend doesn't support --shards.";
+
+  const char *vpnfd = getenv("VPNFD");
+  CHECK(vpnfd) << "VPNFD is not set. Run us with openconnect --script-tun.";
+
+  // The socket carries one packet per datagram, just like a TUN
+  // device.
+  int fd = atoi(vpnfd);
+
+  ip_addr_t ipaddr, netmask, gw;
+
+  CHECK(vpn_address("INTERNAL_IP4_ADDRESS", "X-CSTP-Address", &ipaddr))
+    << "openconnect didn't tell us our address.";
+
+  if (not vpn_address("INTERNAL_IP4_NETMASK", "X-CSTP-Netmask", &netmask)) {
+    IP4_ADDR(&netmask, 255,255,255,255);
+  }
+
+  // There is no link layer, so everything just goes out of this
+  // interface.
+  ip_addr_set_zero(&gw);
+
+  unsigned mtu = vpn_mtu();
+
+  static TunInterface vpnif { io, fd, mtu, timer, false, create_uring(io) };
+
+  netif_add(&vpnif, &ipaddr, &netmask, &gw, &vpnif,
+            &TunInterface::static_netif_init, ip4_input);
 
-  tunif.start_timer();
+  LOG(INFO) << "Using openconnect's socket " << fd << ". Our address is " << ipaddr_ntoa(&ipaddr)
+            << ", MTU " << mtu << ".";
 
+  return &vpnif;
 }
 
 // EOF
@@ -1,3 +1,5 @@
+# Not needed, if openconnect runs us with --script-tun.
+# Add multi_queue to the tuntap line, if you want to use --shards.
 ip tuntap add dev lwip0 mode tun user julian
 ip addr add 10.0.0.1 dev lwip0
 ip link set dev lwip0 up
@@ -0,0 +1,417 @@
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <glog/logging.h>
+
+#include "udp_relay.hpp"
+#include "macgyvernet.hpp"
+#include "resolver.hpp"
+#include "shard.hpp"
+
+namespace {
+
+  enum {
+    // Datagrams from the client are received into these many slots.
+    ARENA_SLOTS = 64,
+
+    // Enough room for lwIP to prepend IP and UDP headers in place.
+    HEADROOM = 64,
+
+    // Larger datagrams are dropped.
+    MAX_DATAGRAM = 2048,
+  };
+
+  // Address types. See RFC 1928.
+  enum : uint8_t {
+    IPV4       = 1,
+    DOMAINNAME = 3,
+  };
+
+}
+
+/// Memory for a single datagram from the client. The pbuf must come
+/// right before the data, because lwIP only prepends headers to
+/// PBUF_RAM pbufs, if the payload is behind the pbuf.
+struct UdpRelay::Slot {
+  struct pbuf_custom pc;
+  uint8_t            mem[HEADROOM + MAX_DATAGRAM];
+};
+
+// lwIP runs on a single thread, so all relays share this arena. Slots
+// are free, unless lwIP (or a pending name lookup) still uses them.
+static std::array<UdpRelay::Slot, ARENA_SLOTS>   arena;
+static std::array<UdpRelay::Slot *, ARENA_SLOTS> free_slots;
+static size_t                                    free_count = 0;
+
+static void release_slot(UdpRelay::Slot *slot)
+{
+  free_slots[free_count++] = slot;
+}
+
+static UdpRelay::Slot *take_slot()
+{
+  static bool initialized = false;
+
+  if (not initialized) {
+    for (auto &slot : arena) {
+      release_slot(&slot);
+    }
+    initialized = true;
+  }
+
+  return free_count ? free_slots[--free_count] : nullptr;
+}
+
+static void slot_pbuf_free(pbuf *p)
+{
+  release_slot(reinterpret_cast<UdpRelay::Slot *>(reinterpret_cast<pbuf_custom *>(p)));
+}
+
+UdpRelay::UdpRelay(asio::io_service &io, Resolver &resolver,
+                   asio::ip::address const &client_address,
+                   asio::ip::address const &local_address)
+  : io_service(io), resolver(resolver),
+    socket(io, asio::ip::udp::endpoint(local_address, 0)),
+    client_address(client_address)
+{
+  socket.non_blocking(true);
+}
+
+UdpRelay::~UdpRelay()
+{
+  if (udp_pcb) {
+    udp_remove(udp_pcb);
+  }
+
+  for (size_t i = 0; i < outgoing_count; i++) {
+    pbuf_free(outgoing[i].p);
+  }
+
+  if (dropped) {
+    LOG(INFO) << "UDP relay dropped " << dropped << " datagrams.";
+  }
+}
+
+bool UdpRelay::start()
+{
+  udp_pcb = udp_new();
+  if (not udp_pcb) {
+    LOG(ERROR) << "lwIP out of memory. Couldn't allocate UDP PCB.";
+    return false;
+  }
+
+  if (not shard_bind_local_port(udp_pcb)) {
+    return false;
+  }
+
+  udp_recv(udp_pcb, static_udp_recv_cb, this);
+  start_receive();
+
+  return true;
+}
+
+void UdpRelay::close()
+{
+  if (closed) {
+    return;
+  }
+
+  closed = true;
+
+  if (udp_pcb) {
+    udp_recv(udp_pcb, nullptr, nullptr);
+    udp_remove(udp_pcb);
+    udp_pcb = nullptr;
+  }
+
+  for (size_t i = 0; i < outgoing_count; i++) {
+    pbuf_free(outgoing[i].p);
+  }
+  outgoing_count = 0;
+
+  // Cancels the pending wait. readable_cb then drops the last
+  // reference.
+  asio::error_code ec;
+  socket.close(ec);
+}
+
+void UdpRelay::start_receive()
+{
+  auto self = shared_from_this();
+  socket.async_receive(asio::null_buffers(), ASIO_CB_SHARED(self, readable_cb));
+}
+
+void UdpRelay::drop_datagrams()
+{
+  uint8_t discard;
+
+  for (unsigned i = 0; i < BATCH; i++) {
+    if (::recv(socket.native_handle(), &discard, sizeof(discard), MSG_DONTWAIT) < 0) {
+      break;
+    }
+    dropped++;
+  }
+}
+
+void UdpRelay::readable_cb(const asio::error_code &error, size_t)
+{
+  if (closed or error == asio::error_code(asio::error::operation_aborted)) {
+    return;
+  } else if (error) {
+    LOG(ERROR) << "Error while waiting for UDP datagrams: " << error.message();
+    return;
+  }
+
+  std::array<Slot *, BATCH>             slots;
+  std::array<struct iovec, BATCH>       iov;
+  std::array<struct sockaddr_in, BATCH> from;
+  std::array<struct mmsghdr, BATCH>     msgs;
+
+  size_t count = 0;
+
+  while (count < BATCH) {
+    Slot *slot = take_slot();
+    if (not slot) {
+      break;
+    }
+
+    slots[count] = slot;
+    iov[count]   = { slot->mem + HEADROOM, MAX_DATAGRAM };
+
+    memset(&msgs[count], 0, sizeof(msgs[count]));
+    msgs[count].msg_hdr.msg_name    = &from[count];
+    msgs[count].msg_hdr.msg_namelen = sizeof(from[count]);
+    msgs[count].msg_hdr.msg_iov     = &iov[count];
+    msgs[count].msg_hdr.msg_iovlen  = 1;
+
+    count++;
+  }
+
+  if (count == 0) {
+    // Everything is still queued in lwIP. Don't spin on the socket.
+    drop_datagrams();
+    start_receive();
+    return;
+  }
+
+  int received = recvmmsg(socket.native_handle(), msgs.data(), count, MSG_DONTWAIT, nullptr);
+  if (received < 0) {
+    if (errno != EAGAIN and errno != EWOULDBLOCK and errno != EINTR) {
+      PLOG_EVERY_N(ERROR, 1000) << "recvmmsg failed";
+    }
+    received = 0;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (i >= size_t(received)) {
+      release_slot(slots[i]);
+    } else if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      dropped++;
+      release_slot(slots[i]);
+    } else {
+      client_datagram(slots[i], msgs[i].msg_len, from[i]);
+    }
+  }
+
+  start_receive();
+}
+
+void UdpRelay::client_datagram(Slot *slot, size_t len, struct sockaddr_in const &from)
+{
+  uint8_t *d = slot->mem + HEADROOM;
+
+  if (from.sin_family != AF_INET or
+      asio::ip::address_v4(ntohl(from.sin_addr.s_addr)) != client_address) {
+    release_slot(slot);
+    return;
+  }
+
+  if (not client_known) {
+    // From now on the kernel only gives us datagrams from the client.
+    asio::ip::udp::endpoint client { client_address, ntohs(from.sin_port) };
+    asio::error_code ec;
+
+    socket.connect(client, ec);
+    if (ec) {
+      LOG(ERROR) << "Couldn't connect UDP relay to client: " << ec.message();
+      release_slot(slot);
+      return;
+    }
+
+    client_known = true;
+  }
+
+  // We don't do fragmentation.
+  if (len < 4 or d[0] != 0 or d[1] != 0 or d[2] != 0) {
+    dropped++;
+    release_slot(slot);
+    return;
+  }
+
+  switch (d[3]) {
+  case IPV4: {
+    if (len < CLIENT_HEADER_BYTES) {
+      break;
+    }
+
+    ip_addr_t addr;
+    memcpy(&addr.addr, d + 4, 4);
+    uint16_t port = d[8] << 8 | d[9];
+
+    send_to_remote(slot, d + CLIENT_HEADER_BYTES, len - CLIENT_HEADER_BYTES, addr, port);
+    return;
+  }
+
+  case DOMAINNAME: {
+    size_t header_len = 5 + d[4] + 2;
+    if (len < header_len) {
+      break;
+    }
+
+    std::string name (reinterpret_cast<const char *>(d + 5), d[4]);
+    uint16_t port = d[header_len - 2] << 8 | d[header_len - 1];
+
+    // The slot stays ours until the name is resolved. Usually the
+    // answer is cached and this returns immediately.
+    std::weak_ptr<UdpRelay> weak_self = shared_from_this();
+    resolver.resolve(name, [weak_self, slot, d, header_len, len, port] (ip_addr_t const *addr) {
+        auto self = weak_self.lock();
+
+        if (not self or not addr) {
+          release_slot(slot);
+          return;
+        }
+
+        self->send_to_remote(slot, d + header_len, len - header_len, *addr, port);
+      });
+    return;
+  }
+
+  default:
+    break;
+  }
+
+  dropped++;
+  release_slot(slot);
+}
+
+void UdpRelay::send_to_remote(Slot *slot, uint8_t *payload, size_t len,
+                              ip_addr_t const &addr, uint16_t port)
+{
+  if (closed) {
+    release_slot(slot);
+    return;
+  }
+
+  slot->pc.custom_free_function = slot_pbuf_free;
+
+  // This doesn't allocate. The slot goes back into the arena, when
+  // lwIP is done with the pbuf.
+  pbuf *p = pbuf_alloced_custom(PBUF_RAW, len, PBUF_RAM, &slot->pc, payload, len);
+  if (not p) {
+    dropped++;
+    release_slot(slot);
+    return;
+  }
+
+  err_t err = udp_sendto(udp_pcb, p, &addr, port);
+  if (err != ERR_OK) {
+    dropped++;
+  }
+
+  pbuf_free(p);
+}
+
+void UdpRelay::udp_recv_cb(pbuf *p, ip_addr_t const *addr, u16_t port)
+{
+  if (not client_known) {
+    pbuf_free(p);
+    return;
+  }
+
+  if (outgoing_count == outgoing.size()) {
+    flush_outgoing();
+  }
+
+  Outgoing &o = outgoing[outgoing_count];
+  size_t iov_len = 0;
+
+  o.header = { 0, 0, 0, IPV4 };
+  memcpy(&o.header[4], &addr->addr, 4);
+  o.header[8] = port >> 8;
+  o.header[9] = port;
+
+  o.iov[iov_len++] = { o.header.data(), o.header.size() };
+
+  for (pbuf *c = p; c; c = c->next) {
+    if (iov_len == o.iov.size()) {
+      dropped++;
+      pbuf_free(p);
+      return;
+    }
+
+    o.iov[iov_len++] = { c->payload, c->len };
+  }
+
+  o.p = p;
+
+  struct mmsghdr &msg = outgoing_msgs[outgoing_count];
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_hdr.msg_iov    = o.iov.data();
+  msg.msg_hdr.msg_iovlen = iov_len;
+
+  outgoing_count++;
+
+  // Everything lwIP hands us while processing the current batch of
+  // packets goes out with a single sendmmsg().
+  if (not flush_scheduled) {
+    auto self = shared_from_this();
+    flush_scheduled = true;
+    io_service.post([this, self] {
+        flush_scheduled = false;
+
+        if (not closed) {
+          flush_outgoing();
+        }
+      });
+  }
+}
+
+void UdpRelay::flush_outgoing()
+{
+  size_t sent = 0;
+
+  while (sent < outgoing_count) {
+    int r = sendmmsg(socket.native_handle(), &outgoing_msgs[sent], outgoing_count - sent, MSG_DONTWAIT);
+
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno != EAGAIN and errno != EWOULDBLOCK) {
+        PLOG_EVERY_N(ERROR, 1000) << "sendmmsg failed";
+      }
+
+      // This is UDP. The client's socket buffer is full, so drop the
+      // rest.
+      dropped += outgoing_count - sent;
+      break;
+    }
+
+    sent += r;
+  }
+
+  for (size_t i = 0; i < outgoing_count; i++) {
+    pbuf_free(outgoing[i].p);
+  }
+
+  outgoing_count = 0;
+}
+
+void UdpRelay::static_udp_recv_cb(void *arg, struct udp_pcb *, pbuf *p,
+                                  ip_addr_t const *addr, u16_t port)
+{
+  static_cast<UdpRelay *>(arg)->udp_recv_cb(p, addr, port);
+}
+
+// EOF
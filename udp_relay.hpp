@@ -0,0 +1,112 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <array>
+#include <memory>
+
+#include <asio/io_service.hpp>
+#include <asio/ip/udp.hpp>
+
+#include <lwip/ip_addr.h>
+#include <lwip/pbuf.h>
+#include <lwip/udp.h>
+
+class Resolver;
+
+/// Relays datagrams for a SOCKS client that has sent UDP ASSOCIATE
+/// (RFC 1928, section 7). Datagrams from the client are received in
+/// batches with recvmmsg() and handed to lwIP from where they were
+/// received. Datagrams from lwIP are sent to the client in batches
+/// with sendmmsg().
+class UdpRelay final : public std::enable_shared_from_this<UdpRelay> {
+public:
+
+  struct Slot;
+
+private:
+
+  enum {
+    // Datagrams per recvmmsg()/sendmmsg() call.
+    BATCH = 32,
+
+    // Maximum number of pbufs in a datagram to the client.
+    MAX_IOV = 16,
+
+    // RSV, FRAG, ATYP, IPv4 address and port.
+    CLIENT_HEADER_BYTES = 10,
+  };
+
+  struct Outgoing {
+    pbuf *p;
+    std::array<uint8_t, CLIENT_HEADER_BYTES> header;
+    std::array<struct iovec, MAX_IOV>        iov;
+  };
+
+  asio::io_service &io_service;
+  Resolver         &resolver;
+
+  // The socket the client sends its datagrams to.
+  asio::ip::udp::socket socket;
+
+  // Only the SOCKS client may use this relay. We learn its port from
+  // the first datagram.
+  asio::ip::address client_address;
+  bool              client_known = false;
+
+  struct udp_pcb *udp_pcb = nullptr;
+
+  // Datagrams from lwIP waiting for the next sendmmsg().
+  std::array<Outgoing, BATCH>        outgoing;
+  std::array<struct mmsghdr, BATCH>  outgoing_msgs;
+  size_t                             outgoing_count  = 0;
+  bool                               flush_scheduled = false;
+
+  uint64_t dropped = 0;
+
+  // Set by close(). Late completions and name lookups are ignored.
+  bool closed = false;
+
+  void start_receive();
+  void readable_cb(const asio::error_code &error, size_t);
+  void drop_datagrams();
+
+  void client_datagram(Slot *slot, size_t len, struct sockaddr_in const &from);
+  void send_to_remote(Slot *slot, uint8_t *payload, size_t len, ip_addr_t const &addr, uint16_t port);
+
+  void flush_outgoing();
+
+  void udp_recv_cb(pbuf *p, ip_addr_t const *addr, u16_t port);
+
+  static void static_udp_recv_cb(void *arg, struct udp_pcb *pcb, pbuf *p,
+                                 ip_addr_t const *addr, u16_t port);
+
+public:
+
+  UdpRelay(asio::io_service &io, Resolver &resolver,
+           asio::ip::address const &client_address,
+           asio::ip::address const &local_address);
+  ~UdpRelay();
+
+  static std::shared_ptr<UdpRelay> create(asio::io_service &io, Resolver &resolver,
+                                          asio::ip::address const &client_address,
+                                          asio::ip::address const &local_address)
+  {
+    return std::make_shared<UdpRelay>(io, resolver, client_address, local_address);
+  }
+
+  /// Allocate the lwIP side and start relaying. Returns false, if lwIP
+  /// is out of memory.
+  bool start();
+
+  /// Stop relaying and give the socket and the lwIP PCB back. The
+  /// relay holds a reference to itself while it waits for datagrams,
+  /// so dropping the last outside reference is not enough.
+  void close();
+
+  /// The address the client needs to send its datagrams to.
+  asio::ip::udp::endpoint local_endpoint() const { return socket.local_endpoint(); }
+};
+
+// EOF
@@ -0,0 +1,187 @@
+#ifdef MACGYVERNET_IO_URING
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <asio/io_service.hpp>
+#include <asio/posix/stream_descriptor.hpp>
+
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+#include <array>
+#include <cerrno>
+#include <system_error>
+
+#include "macgyvernet.hpp"
+#include "uring.hpp"
+#include "trace.hpp"
+
+DEFINE_int32(io_uring_entries, 1024, "Submission queue size of each io_uring");
+DEFINE_bool(io_uring_sqpoll, false, "Let a kernel thread poll the io_uring for submissions. Saves the submit system call, but keeps a CPU busy.");
+
+static int create_eventfd()
+{
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0) {
+    throw std::system_error(std::error_code(errno, std::system_category()), "eventfd");
+  }
+
+  return fd;
+}
+
+Uring::Uring(asio::io_service &io)
+  : io(io), event_fd(io, create_eventfd())
+{
+  io_uring_params params {};
+
+  if (FLAGS_io_uring_sqpoll) {
+    params.flags          |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle  = 1000;
+  }
+
+  int err = io_uring_queue_init_params(FLAGS_io_uring_entries, &ring, &params);
+  if (err < 0) {
+    throw std::system_error(std::error_code(-err, std::system_category()), "io_uring_queue_init");
+  }
+
+  // Gather lists only have to live until they are submitted.
+  CHECK(params.features & IORING_FEAT_SUBMIT_STABLE) << "Kernel too old for --io_uring.";
+
+  err = io_uring_register_eventfd(&ring, event_fd.native_handle());
+  if (err < 0) {
+    throw std::system_error(std::error_code(-err, std::system_category()), "io_uring_register_eventfd");
+  }
+
+  LOG(INFO) << "io_uring with " << params.sq_entries << " entries"
+            << (FLAGS_io_uring_sqpoll ? " and submission polling" : "") << ".";
+
+  wait_completions();
+}
+
+Uring::~Uring()
+{
+  io_uring_queue_exit(&ring);
+}
+
+void Uring::wait_completions()
+{
+  event_fd.async_read_some(asio::null_buffers(), ASIO_CB(completions_cb));
+}
+
+void Uring::completions_cb(asio::error_code const &error, size_t)
+{
+  if (error) {
+    LOG(ERROR) << "Error waiting for io_uring completions: " << error;
+    return;
+  }
+
+  uint64_t events;
+  if (::read(event_fd.native_handle(), &events, sizeof(events)) < 0 and errno != EAGAIN) {
+    PLOG(ERROR) << "Reading io_uring eventfd";
+  }
+
+  // Copy completions out before running them, because they may queue
+  // new operations that complete while we are still here.
+  struct Completion {
+    UringOp *op;
+    int      res;
+    unsigned flags;
+  };
+
+  std::array<io_uring_cqe *, 64> cqes;
+  std::array<Completion, 64>     batch;
+  unsigned                       n;
+
+  while ((n = io_uring_peek_batch_cqe(&ring, cqes.data(), cqes.size())) > 0) {
+    for (unsigned i = 0; i < n; i++) {
+      batch[i] = { static_cast<UringOp *>(io_uring_cqe_get_data(cqes[i])), cqes[i]->res, cqes[i]->flags };
+    }
+
+    io_uring_cq_advance(&ring, n);
+
+    for (unsigned i = 0; i < n; i++) {
+      batch[i].op->complete(batch[i].op, batch[i].res, batch[i].flags);
+    }
+  }
+
+  // Reaping makes room in the completion queue, so a submission that
+  // failed with EBUSY may go through now.
+  if (not room_waiters.empty()) {
+    submit();
+    notify_room();
+  }
+
+  wait_completions();
+}
+
+void Uring::notify_room()
+{
+  if (room_waiters.empty() or space_left() == 0) {
+    return;
+  }
+
+  auto waiters = std::move(room_waiters);
+  room_waiters.clear();
+
+  for (auto &fn : waiters) {
+    fn();
+  }
+}
+
+void Uring::post_submit()
+{
+  if (submit_posted) {
+    return;
+  }
+
+  submit_posted = true;
+  io.post([this] {
+      submit_posted = false;
+      submit();
+      notify_room();
+    });
+}
+
+io_uring_sqe *Uring::get_sqe(UringOp *op)
+{
+  io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+
+  if (not sqe) {
+    submit();
+    sqe = io_uring_get_sqe(&ring);
+  }
+
+  if (not sqe) {
+    TRACE << "io_uring submission queue full.";
+    return nullptr;
+  }
+
+  io_uring_sqe_set_data(sqe, op);
+  post_submit();
+
+  return sqe;
+}
+
+void Uring::submit()
+{
+  int ret;
+
+  while ((ret = io_uring_submit(&ring)) < 0) {
+    if (ret == -EINTR) {
+      continue;
+    }
+
+    // The completion queue is full. Try again after reaping.
+    if (ret == -EBUSY or ret == -EAGAIN) {
+      post_submit();
+      return;
+    }
+
+    LOG(ERROR) << "io_uring_submit: " << std::error_code(-ret, std::system_category()).message();
+    return;
+  }
+}
+
+#endif
+
+// EOF
@@ -0,0 +1,71 @@
+#pragma once
+
+// Declared in every build, so users can pass a null pointer around
+// without #ifdefs.
+class Uring;
+
+// The rest only exists with `scons uring=1`. Needs liburing.
+#ifdef MACGYVERNET_IO_URING
+
+#include <asio/io_service.hpp>
+#include <asio/posix/stream_descriptor.hpp>
+
+#include <liburing.h>
+
+#include <functional>
+#include <vector>
+
+/// An operation in flight. Embed it as the first member and use its
+/// address as user data. res is the operation's result or -errno.
+struct UringOp {
+  void (*complete)(UringOp *op, int res, unsigned flags);
+};
+
+/// An io_uring that is driven from an io_service. Operations prepared
+/// during a handler go to the kernel together once the handler
+/// returns. Completions are signalled via an eventfd, so one reactor
+/// wakeup reaps all of them.
+class Uring {
+  asio::io_service              &io;
+  io_uring                       ring;
+  asio::posix::stream_descriptor event_fd;
+
+  bool submit_posted = false;
+
+  // Called once the submission queue has room again.
+  std::vector<std::function<void()>> room_waiters;
+
+  void post_submit();
+  void notify_room();
+  void wait_completions();
+  void completions_cb(asio::error_code const &error, size_t);
+
+public:
+
+  explicit Uring(asio::io_service &io);
+  ~Uring();
+
+  Uring(Uring const &) = delete;
+  Uring &operator=(Uring const &) = delete;
+
+  io_uring *get() { return &ring; }
+
+  /// An empty submission queue entry for op. It is submitted
+  /// automatically. Returns nullptr, if the queue is full. Use
+  /// when_room() to try again later.
+  io_uring_sqe *get_sqe(UringOp *op);
+
+  /// Entries get_sqe() hands out without submitting in between.
+  /// Linked entries must fit.
+  unsigned space_left() { return io_uring_sq_space_left(&ring); }
+
+  /// Call fn once get_sqe() may succeed again.
+  void when_room(std::function<void()> fn) { room_waiters.push_back(std::move(fn)); }
+
+  /// Submit everything prepared so far right away.
+  void submit();
+};
+
+#endif
+
+// EOF
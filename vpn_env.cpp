@@ -0,0 +1,77 @@
+#include <cstdlib>
+#include <sstream>
+#include <gflags/gflags.h>
+
+#include "vpn_env.hpp"
+
+DEFINE_string(dns_servers, "", "Comma-separated list of DNS servers behind the VPN");
+
+std::vector<std::string> cstp_option(std::string const &name)
+{
+  std::vector<std::string> values;
+  const char *options = getenv("CISCO_CSTP_OPTIONS");
+
+  if (not options) {
+    return values;
+  }
+
+  std::istringstream lines { options };
+  std::string prefix = name + "=";
+
+  for (std::string line; std::getline(lines, line); ) {
+    if (line.compare(0, prefix.size(), prefix) == 0) {
+      values.push_back(line.substr(prefix.size()));
+    }
+  }
+
+  return values;
+}
+
+std::vector<std::string> env_list(const char *name)
+{
+  std::vector<std::string> values;
+  const char *value = getenv(name);
+
+  if (value) {
+    std::istringstream words { value };
+    for (std::string word; words >> word; ) {
+      values.push_back(word);
+    }
+  }
+
+  return values;
+}
+
+std::string vpn_setting(const char *env_name, std::string const &cstp_name)
+{
+  const char *value = getenv(env_name);
+
+  if (value and *value) {
+    return value;
+  }
+
+  auto values = cstp_option(cstp_name);
+  return values.empty() ? std::string() : values.front();
+}
+
+std::vector<std::string> vpn_dns_servers()
+{
+  std::vector<std::string> servers;
+
+  if (not FLAGS_dns_servers.empty()) {
+    std::istringstream list { FLAGS_dns_servers };
+    for (std::string server; std::getline(list, server, ','); ) {
+      servers.push_back(server);
+    }
+    return servers;
+  }
+
+  servers = env_list("INTERNAL_IP4_DNS");
+  if (servers.empty()) {
+    servers = cstp_option("X-CSTP-DNS");
+  }
+
+  return servers;
+}
+
+// EOF
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// openconnect passes the VPN configuration to its script in
+// environment variables. See doc/anyconnect-env.txt.
+
+/// All values of an X-CSTP-* option in CISCO_CSTP_OPTIONS.
+std::vector<std::string> cstp_option(std::string const &name);
+
+/// Split an environment variable at whitespace. Empty, if it is not
+/// set.
+std::vector<std::string> env_list(const char *name);
+
+/// A setting that openconnect passes either in its own variable or as
+/// an X-CSTP-* option. The variable wins. Empty, if neither is set.
+std::string vpn_setting(const char *env_name, std::string const &cstp_name);
+
+/// The DNS servers behind the VPN. These come from --dns_servers, if
+/// given, and from openconnect's environment otherwise.
+std::vector<std::string> vpn_dns_servers();
+
+// EOF